@@ -6,6 +6,11 @@
 #include <string>
 
 #include "evaluator.hpp"
+#include "session.hpp"
+#include "cache.hpp"
+#include "source.hpp"
+#include "vm.hpp"
+#include "trace.hpp"
 
 using namespace CS;
 using std::string;
@@ -24,26 +29,93 @@ string Helpers(int cmd) {
     switch (cmd) {
         case 1:
             return "no help";
-        case 2:
-            exit(0);
         default:
             assert(false);
     }
 }
 
-int main()
-{
-    //freopen("in.data", "r", stdin);
-    Evaluator evaluator;
+/* the result of a line, reusing 'out' */
+void Show(Evaluator& evaluator, const string& line, string& out) {
+    out.clear();
+    evaluator.Run(line).Append(out, Format::kShortest);
+}
+
+void Show(Session& session, const string& line, string& out) {
+    out = session.Evaluate(line);
+}
+
+/* works with both Evaluator and Session */
+template <typename Interpreter>
+void Loop(Interpreter& interpreter) {
     std::cout << "Welcome to CS!" << std::endl;
+    string out;
     for (std::string line; ;) {
         std::cout << "CS: ";
         if (!std::getline(std::cin, line)) break;
-        if (CMD(line) == 0)
-            std::cout << "res: " << evaluator.Evaluate(line + "\n") << std::endl;
+        if (CMD(line) == 0) {
+            line += '\n';
+            Show(interpreter, line, out);
+            std::cout << "res: " << out << std::endl;
+        }
+        else if (CMD(line) == 2)
+            break;
         else 
             std::cout << Helpers(CMD(line)) << std::endl;
     }
+}
+
+/* compile a script, or take it from the cache beside it, and run it on the vm */
+int Run(const string& path) {
+    Result<Compiler::Program> result = Cache::CompileFile(path);
+    if (!result.Ok()) {
+        string source;
+        Cache::ReadFile(path, source);
+        SourceMap map(source.c_str());
+        for (auto& i: result.diagnostics)
+            std::cerr << (i.offset < 0 ? i.message : path + ":" + map.Format(i)) << std::endl;
+        return 1;
+    }
+    VM::VM vm;
+    return vm.Execute(result.value.instructions, result.value.symbols) && vm.Fault() < 0 ? 0 : 1;
+}
+
+#ifdef CS_TRACE
+/* built with tracing, the stages are written as Chrome trace events when leaving */
+struct TraceFile {
+    ~TraceFile() {
+        const char* path = getenv("CS_TRACE_FILE");
+        if (!Trace::Save(path ? path : "cs.trace.json"))
+            std::cerr << "could not save the trace" << std::endl;
+    }
+};
+#endif
+
+/*
+ * CS [snapshot]: resume from the snapshot if it exists, and save to it when leaving
+ * CS --vm: compile every line and run it on the vm
+ * CS --run script: run a script on the vm, compiled once and cached in 'script.csc'
+ */
+int main(int argc, char* argv[])
+{
+    //freopen("in.data", "r", stdin);
+#ifdef CS_TRACE
+    TraceFile trace;
+#endif
+    if (argc > 1 && string(argv[1]) == "--vm") {
+        Session session;
+        Loop(session);
+        return 0;
+    }
+    if (argc > 2 && string(argv[1]) == "--run")
+        return Run(argv[2]);
+
+    Evaluator evaluator;
+    const char* snapshot = argc > 1 ? argv[1] : nullptr;
+    if (snapshot)
+        evaluator.Restore(snapshot);
+    Loop(evaluator);
 
+    if (snapshot && !evaluator.Save(snapshot))
+        std::cerr << "could not save " << snapshot << std::endl;
     return 0;
 }
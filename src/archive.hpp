@@ -0,0 +1,318 @@
+/**
+ * Many compiled programs in one file, each in a section of its own.
+ * A section is the bytecode of a program with its symbols, compressed on its own,
+ * and an index at the head of the file gives where each one is. Opening an archive
+ * reads the index only, and a section is read and decompressed the first time its
+ * program runs, so a start touches the code it runs and nothing else.
+ *
+ * "CSAR", version, count, index bytes          (u32 each, little endian)
+ * index: per program, name size, name, offset (u64), packed size, size, checksum
+ * section: symbol count, per symbol name size, name, index, then the bytecode
+ */
+
+#ifndef ARCHIVE_HPP
+#define ARCHIVE_HPP
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "opcode.hpp"
+#include "bytecode.hpp"
+#include "compress.hpp"
+#include "vm.hpp"
+
+namespace CS {
+    namespace Archive {
+        using std::string;
+        using std::vector;
+        using OpCode::InstructionTable;
+        using OpCode::SymbolTable;
+
+        const char kMagic[] = "CSAR";
+        const uint32_t kVersion = 1;
+        const uint32_t kMaxSection = 1 << 28; // bytes of a section decompressed
+
+        typedef vector<uint8_t> Buffer;
+
+        /* FNV-1a of a section, so a damaged file is refused instead of run */
+        static uint32_t Checksum(const Buffer& data) {
+            uint32_t hash = 2166136261u;
+            for (uint8_t byte: data) {
+                hash ^= byte;
+                hash *= 16777619u;
+            }
+            return hash;
+        }
+
+        static void Put32(Buffer& out, uint32_t v) {
+            for (int i = 0; i < 4; i++)
+                out.push_back(static_cast<uint8_t>(v >> (8 * i)));
+        }
+
+        static void Put64(Buffer& out, uint64_t v) {
+            Put32(out, static_cast<uint32_t>(v));
+            Put32(out, static_cast<uint32_t>(v >> 32));
+        }
+
+        static void PutString(Buffer& out, const string& s) {
+            Put32(out, s.size());
+            out.insert(out.end(), s.begin(), s.end());
+        }
+
+        /* reads from a buffer which may be cut short, every Get fails past the end */
+        class Cursor {
+            public:
+                Cursor(const uint8_t* data, size_t size): p_(data), end_(data + size) {}
+
+                bool Get32(uint32_t& v) {
+                    if (end_ - p_ < 4) return false;
+                    v = p_[0] | p_[1] << 8 | p_[2] << 16 | static_cast<uint32_t>(p_[3]) << 24;
+                    p_ += 4;
+                    return true;
+                }
+
+                bool Get64(uint64_t& v) {
+                    uint32_t low, high;
+                    if (!Get32(low) || !Get32(high)) return false;
+                    v = static_cast<uint64_t>(high) << 32 | low;
+                    return true;
+                }
+
+                bool GetString(string& s) {
+                    uint32_t size;
+                    if (!Get32(size) || static_cast<size_t>(end_ - p_) < size) return false;
+                    s.assign(reinterpret_cast<const char*>(p_), size);
+                    p_ += size;
+                    return true;
+                }
+
+                const uint8_t* Position() const {
+                    return p_;
+                }
+
+                size_t Left() const {
+                    return end_ - p_;
+                }
+
+            private:
+                const uint8_t* p_;
+                const uint8_t* end_;
+        };
+
+        /* a program as the vm takes it */
+        struct Section {
+            Bytecode::Code code;
+            SymbolTable symbols;
+        };
+
+        class Writer {
+            public:
+                /* false if the instructions cannot be encoded, see Bytecode::Encode */
+                bool Add(const string& name, const InstructionTable& ins_tbl,
+                        const SymbolTable& sym_tbl) {
+                    Bytecode::Code code;
+                    if (!Bytecode::Encode(ins_tbl, code))
+                        return false;
+                    Buffer raw;
+                    Put32(raw, sym_tbl.size());
+                    for (auto& i: sym_tbl) {
+                        PutString(raw, i.first);
+                        Put32(raw, i.second);
+                    }
+                    raw.insert(raw.end(), code.begin(), code.end());
+                    Packed packed = { name, Compress::Compress(raw), static_cast<uint32_t>(raw.size()),
+                        Checksum(raw) };
+                    sections_.push_back(packed);
+                    return true;
+                }
+
+                bool Save(const char* file_path) const {
+                    Buffer index;
+                    /* the sections start after the head and the index */
+                    uint64_t offset = 16;
+                    for (auto& i: sections_)
+                        offset += 4 + i.name.size() + 8 + 4 + 4 + 4;
+                    for (auto& i: sections_) {
+                        PutString(index, i.name);
+                        Put64(index, offset);
+                        Put32(index, i.data.size());
+                        Put32(index, i.size);
+                        Put32(index, i.checksum);
+                        offset += i.data.size();
+                    }
+                    Buffer head(kMagic, kMagic + 4);
+                    Put32(head, kVersion);
+                    Put32(head, sections_.size());
+                    Put32(head, index.size());
+                    FILE* output = fopen(file_path, "wb");
+                    if (output == nullptr)
+                        return false;
+                    bool ok = fwrite(head.data(), 1, head.size(), output) == head.size() &&
+                        fwrite(index.data(), 1, index.size(), output) == index.size();
+                    for (auto& i: sections_)
+                        ok = ok && fwrite(i.data.data(), 1, i.data.size(), output) == i.data.size();
+                    return fclose(output) == 0 && ok;
+                }
+
+            private:
+                struct Packed {
+                    string name;
+                    Buffer data;
+                    uint32_t size;
+                    uint32_t checksum;
+                };
+
+                vector<Packed> sections_;
+        };
+
+        /*
+         * An open archive keeps its file until it is destroyed, and every section
+         * it has loaded. Like the deserializer, it trusts no size in the file.
+         */
+        class Reader {
+            public:
+                Reader(): file_(nullptr), size_(0), loaded_(0) {}
+
+                ~Reader() {
+                    if (file_)
+                        fclose(file_);
+                }
+
+                Reader(const Reader&) = delete;
+                Reader& operator = (const Reader&) = delete;
+
+                /* reads the index only */
+                bool Open(const char* file_path) {
+                    file_ = fopen(file_path, "rb");
+                    if (file_ == nullptr)
+                        return false;
+                    if (fseek(file_, 0, SEEK_END) != 0)
+                        return Fail();
+                    long size = ftell(file_);
+                    if (size < 16 || fseek(file_, 0, SEEK_SET) != 0)
+                        return Fail();
+                    size_ = size;
+                    uint8_t head[16];
+                    if (fread(head, 1, 16, file_) != 16 || memcmp(head, kMagic, 4) != 0)
+                        return Fail();
+                    Cursor header(head + 4, 12);
+                    uint32_t version, count, bytes;
+                    header.Get32(version);
+                    header.Get32(count);
+                    header.Get32(bytes);
+                    if (version != kVersion || bytes > size_ - 16)
+                        return Fail();
+                    Buffer index(bytes);
+                    if (bytes && fread(index.data(), 1, bytes, file_) != bytes)
+                        return Fail();
+                    Cursor reader(index.data(), index.size());
+                    for (uint32_t i = 0; i < count; i++) {
+                        string name;
+                        Entry entry;
+                        if (!reader.GetString(name) || !reader.Get64(entry.offset) ||
+                                !reader.Get32(entry.packed) || !reader.Get32(entry.size) ||
+                                !reader.Get32(entry.checksum))
+                            return Fail();
+                        if (entry.offset > size_ || entry.packed > size_ - entry.offset)
+                            return Fail();
+                        if (!index_.emplace(name, std::move(entry)).second)
+                            return Fail();
+                    }
+                    return true;
+                }
+
+                size_t Size() const {
+                    return index_.size();
+                }
+
+                bool Contains(const string& name) const {
+                    return index_.count(name) != 0;
+                }
+
+                /* sections decompressed so far */
+                size_t Loaded() const {
+                    return loaded_;
+                }
+
+                /* the section of a program, read on the first call, nullptr if absent or damaged */
+                const Section* Load(const string& name) {
+                    auto found = index_.find(name);
+                    if (found == index_.end())
+                        return nullptr;
+                    Entry& entry = found->second;
+                    if (!entry.section && !entry.damaged && !Read(entry))
+                        entry.damaged = true;
+                    return entry.section.get();
+                }
+
+                /* run a program, loading it first */
+                bool Execute(VM::VM& vm, const string& name) {
+                    const Section* section = Load(name);
+                    if (section == nullptr) {
+                        std::cerr << "archive error: no program " << name << std::endl;
+                        return false;
+                    }
+                    return vm.Execute(section->code, section->symbols);
+                }
+
+            private:
+                struct Entry {
+                    Entry(): offset(0), packed(0), size(0), checksum(0), damaged(false) {}
+
+                    uint64_t offset;
+                    uint32_t packed;
+                    uint32_t size;
+                    uint32_t checksum;
+                    bool damaged;
+                    std::unique_ptr<Section> section;
+                };
+
+                bool Fail() {
+                    fclose(file_);
+                    file_ = nullptr;
+                    index_.clear();
+                    return false;
+                }
+
+                bool Read(Entry& entry) {
+                    /* a size the packed bytes cannot make is refused before it is allocated */
+                    if (entry.size > kMaxSection || entry.size > Compress::MaxDecompressed(entry.packed))
+                        return false;
+                    Buffer packed(entry.packed);
+                    if (fseek(file_, entry.offset, SEEK_SET) != 0 ||
+                            (entry.packed && fread(packed.data(), 1, entry.packed, file_) != entry.packed))
+                        return false;
+                    Buffer raw;
+                    if (!Compress::Decompress(packed.data(), packed.size(), raw, entry.size) ||
+                            Checksum(raw) != entry.checksum)
+                        return false;
+                    std::unique_ptr<Section> section(new Section());
+                    Cursor reader(raw.data(), raw.size());
+                    uint32_t count;
+                    if (!reader.Get32(count))
+                        return false;
+                    for (uint32_t i = 0; i < count; i++) {
+                        string symbol;
+                        uint32_t index;
+                        if (!reader.GetString(symbol) || !reader.Get32(index))
+                            return false;
+                        section->symbols.emplace(symbol, static_cast<int>(index));
+                    }
+                    section->code.assign(reader.Position(), reader.Position() + reader.Left());
+                    entry.section = std::move(section);
+                    ++loaded_;
+                    return true;
+                }
+
+                FILE* file_;
+                uint64_t size_;
+                std::unordered_map<string, Entry> index_;
+                size_t loaded_;
+        };
+    }
+}
+#endif
@@ -0,0 +1,404 @@
+/* benchmarks are measured in release mode */
+#define NDEBUG
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "scanner.hpp"
+#include "parser.hpp"
+#include "compiler.hpp"
+#include "evaluator.hpp"
+#include "vm.hpp"
+#include "bytecode.hpp"
+#include "archive.hpp"
+#include "serializer.hpp"
+#include "cache.hpp"
+#include "scheduler.hpp"
+
+using namespace CS;
+
+/* run 'fun' 'times' times and print the average cost of one run */
+template <typename Fun>
+double Measure(const char* name, int times, Fun fun) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < times; i++)
+        fun();
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / times;
+    printf("%-40s %12.0f ns\n", name, ns);
+    return ns;
+}
+
+/* a = 1 + 2 * 3 - 4 / 5 + ... with 'terms' numbers */
+std::string LongExpression(int terms) {
+    static const char* ops[] = { " + ", " * ", " - ", " / " };
+    std::string code = "a = 1";
+    for (int i = 1; i < terms; i++)
+        code += ops[i % 4] + std::to_string(i % 9 + 1);
+    return code + ";\n";
+}
+
+void BenchParser() {
+    printf("-----parser bench-----\n");
+    int sizes[] = { 10, 100, 1000, 10000 };
+    for (int terms : sizes) {
+        TokenList token_list = Scanner::Scan(LongExpression(terms));
+        Parser parser;
+        std::string name = "parse " + std::to_string(terms) + " terms";
+        Measure(name.c_str(), 1000000 / terms, [&]() {
+            std::shared_ptr<SyntaxTree> tree(parser.Parse(token_list));
+        });
+    }
+    printf("\n");
+}
+
+/* 'count' variables, each computed from the one before */
+std::string LongScript(int count) {
+    std::string code = "int v;\nv = 1;\n";
+    for (int i = 0; i < count; i++) {
+        std::string id = "v";
+        for (int n = i; n; n /= 26)
+            id += 'a' + n % 26;
+        code += "int " + id + "x;\n" + id + "x = v * 3 + " + std::to_string(i) + " - v / 2;\n";
+    }
+    return code;
+}
+
+void BenchCompile() {
+    printf("-----compile bench (%u cores)-----\n", std::thread::hardware_concurrency());
+    std::string code = LongScript(10000);
+    Measure("sequential 20000 statements", 5, [&]() {
+        Compiler::Compile(code);
+    });
+    int threads[] = { 1, 2, 4, 8 };
+    for (int n : threads) {
+        std::string name = "parallel 20000 statements, " + std::to_string(n) + " threads";
+        Measure(name.c_str(), 5, [&]() {
+            Compiler::CompileParallel(code, n);
+        });
+    }
+    printf("\n");
+}
+
+void BenchBytecode() {
+    printf("-----bytecode bench-----\n");
+    Result<Compiler::Program> program = Compiler::Compile(LongScript(10000));
+    const OpCode::InstructionTable& table = program.value.instructions;
+    Bytecode::Code code;
+    Bytecode::Encode(table, code);
+    printf("%-40s %12zu bytes\n", "64-bit instructions", table.size() * sizeof(long long));
+    printf("%-40s %12zu bytes\n", "bytecode", code.size());
+    /* both include the verifier, the bytecode also its decoding */
+    Measure("run 64-bit instructions", 20, [&]() {
+        VM::VM vm;
+        vm.Execute(table, program.value.symbols);
+    });
+    Measure("run bytecode", 20, [&]() {
+        VM::VM vm;
+        vm.Execute(code, program.value.symbols);
+    });
+    Measure("encode", 20, [&]() {
+        Bytecode::Encode(table, code);
+    });
+    OpCode::InstructionTable decoded;
+    Measure("decode", 20, [&]() {
+        Bytecode::Decode(code, decoded);
+    });
+    printf("\n");
+}
+
+void BenchArchive() {
+    printf("-----archive bench-----\n");
+    /* 100 programs of 200 statements, shipped as text files and as one archive */
+    const int count = 100;
+    Result<Compiler::Program> program = Compiler::Compile(LongScript(100));
+    Archive::Writer writer;
+    size_t text = 0;
+    for (int i = 0; i < count; i++) {
+        std::string name = "./bench" + std::to_string(i) + ".oc";
+        Serializer::Serialize(std::make_pair(&program.value.instructions, &program.value.symbols),
+                name.c_str());
+        FILE* file = fopen(name.c_str(), "r");
+        fseek(file, 0, SEEK_END);
+        text += ftell(file);
+        fclose(file);
+        writer.Add(std::to_string(i), program.value.instructions, program.value.symbols);
+    }
+    writer.Save("./bench.csar");
+    FILE* file = fopen("./bench.csar", "r");
+    fseek(file, 0, SEEK_END);
+    printf("%-40s %12zu bytes\n", "100 serialized programs", text);
+    printf("%-40s %12ld bytes\n", "archive of 100 programs", ftell(file));
+    fclose(file);
+    Measure("deserialize 100, run 1", 5, [&]() {
+        std::vector<std::pair<OpCode::InstructionTable*, OpCode::SymbolTable*>> programs;
+        for (int i = 0; i < count; i++)
+            programs.push_back(Serializer::Deserialize(("./bench" + std::to_string(i) + ".oc").c_str()));
+        VM::VM vm;
+        vm.Execute(*programs[7].first, *programs[7].second);
+        for (auto& i: programs) {
+            delete i.first;
+            delete i.second;
+        }
+    });
+    Measure("open archive of 100, run 1", 5, [&]() {
+        Archive::Reader reader;
+        reader.Open("./bench.csar");
+        VM::VM vm;
+        reader.Execute(vm, "7");
+    });
+    for (int i = 0; i < count; i++)
+        remove(("./bench" + std::to_string(i) + ".oc").c_str());
+    remove("./bench.csar");
+    printf("\n");
+}
+
+void BenchCache() {
+    printf("-----cache bench-----\n");
+    const char* path = "./bench.cs";
+    FILE* file = fopen(path, "w");
+    fputs(LongScript(10000).c_str(), file);
+    fclose(file);
+    std::string cache = Cache::CachePath(path);
+    Measure("compile 20000 statements from file", 5, [&]() {
+        remove(cache.c_str());
+        Cache::CompileFile(path);
+    });
+    Measure("load 20000 statements from cache", 5, [&]() {
+        Cache::CompileFile(path);
+    });
+    remove(path);
+    remove(cache.c_str());
+    printf("\n");
+}
+
+void BenchPool() {
+    printf("-----pool bench-----\n");
+    Evaluator eval;
+    std::string line = LongExpression(200);
+    eval.Evaluate(line);
+    const int times = 200;
+    Pool::Stats before = Pool::Statistics();
+    Measure("evaluate 200 terms", times, [&]() {
+        eval.Evaluate(line);
+    });
+    Pool::Stats after = Pool::Statistics();
+    /* without the pool, every allocation it serves is a malloc */
+    printf("%-40s %12.1f\n", "pool allocations per evaluate",
+            double(after.allocations - before.allocations) / times);
+    printf("%-40s %12.1f\n", "mallocs per evaluate",
+            double(after.blocks - before.blocks + after.large - before.large) / times);
+
+    std::vector<void*> objects(1000);
+    Measure("1000 x malloc/free 152 bytes", 1000, [&]() {
+        for (auto& i: objects)
+            i = malloc(152);
+        for (auto& i: objects)
+            free(i);
+    });
+    Measure("1000 x pool allocate/free 152 bytes", 1000, [&]() {
+        for (auto& i: objects)
+            i = Pool::Allocate(152);
+        for (auto& i: objects)
+            Pool::Free(i, 152);
+    });
+    printf("\n");
+}
+
+void BenchEvaluation() {
+    printf("-----evaluation bench-----\n");
+    Evaluator eval;
+    eval.Evaluate("{ double a; double b; int c; }\n");
+    std::string block = "{ a = 1.5 * 3; b = a / 7; c = 42; }\n";
+    const int times = 20000;
+    Pool::Stats before = Pool::Statistics();
+    Measure("3 statements, as text", times, [&]() {
+        eval.Evaluate(block);
+    });
+    Measure("3 statements, as results", times, [&]() {
+        eval.Run(block);
+    });
+    std::string out;
+    Measure("3 statements, shortest into a buffer", times, [&]() {
+        out.clear();
+        eval.Run(block).Append(out, Format::kShortest);
+    });
+    Pool::Stats after = Pool::Statistics();
+    printf("%-40s %12.1f\n", "pool allocations per evaluate",
+            double(after.allocations - before.allocations) / (3 * times));
+    printf("\n");
+}
+
+bool Always(VM::VM&) {
+    return true;
+}
+
+void BenchScheduler() {
+    printf("-----scheduler bench-----\n");
+    std::string code = "int a;\n";
+    for (int i = 0; i < 50; i++)
+        code += "a = a + " + std::to_string(i) + ";\nready();\n";
+    Result<Compiler::Program> program = Compiler::Compile(code);
+    const int scripts = 10000;
+    auto load = [&]() {
+        std::unique_ptr<VM::VM> vm(new VM::VM());
+        vm->Register("ready", Always);
+        vm->Load(program.value.instructions, program.value.symbols);
+        return vm;
+    };
+    Measure("10000 scripts, one after another", 1, [&]() {
+        for (int i = 0; i < scripts; i++)
+            load()->Resume(1L << 30);
+    });
+    for (long quantum: { 16L, 1000L }) {
+        std::string name = "10000 scripts, scheduled, quantum " + std::to_string(quantum);
+        Measure(name.c_str(), 1, [&]() {
+            VM::Scheduler scheduler(0, quantum);
+            for (int i = 0; i < scripts; i++)
+                scheduler.Spawn(load());
+            scheduler.Wait();
+        });
+    }
+    printf("\n");
+}
+
+void BenchImage() {
+    printf("-----image bench-----\n");
+    std::string code = "int a;\n";
+    for (int i = 0; i < 5000; i++)
+        code += "a = a + " + std::to_string(i % 9) + ";\n";
+    Result<Compiler::Program> program = Compiler::Compile(code);
+    VM::ImagePtr image = VM::Image::Make(program.value.instructions, program.value.symbols);
+    const int vms = 100;
+    Measure("100 vms, each with a verified copy", 10, [&]() {
+        std::vector<std::unique_ptr<VM::VM>> all;
+        for (int i = 0; i < vms; i++) {
+            all.emplace_back(new VM::VM());
+            all.back()->Load(program.value.instructions, program.value.symbols);
+        }
+    });
+    Measure("100 vms, sharing one image", 10, [&]() {
+        std::vector<std::unique_ptr<VM::VM>> all;
+        for (int i = 0; i < vms; i++) {
+            all.emplace_back(new VM::VM());
+            all.back()->Load(image);
+        }
+    });
+    printf("%-40s %12zu\n", "bytes of code per copy",
+            program.value.instructions.size() * sizeof(long long));
+    VM::ImageStore store(image);
+    Measure("get the published image", 100000, [&]() {
+        VM::ImagePtr now = store.Get();
+    });
+    printf("\n");
+}
+
+void BenchFuse() {
+    printf("-----superinstruction bench-----\n");
+    std::string code = "int a;\nint b;\n";
+    for (int i = 0; i < 5000; i++)
+        code += i % 2 ? "a = a + 3;\n" : "b = a - b * 2;\n";
+    Result<Compiler::Program> program = Compiler::Compile(code);
+    OpCode::InstructionTable fused;
+    std::vector<int> origin;
+    OpCode::Fuse(program.value.instructions, 0, fused, origin);
+    printf("%-40s %12zu\n", "instructions", program.value.instructions.size());
+    printf("%-40s %12zu\n", "instructions fused", fused.size());
+    /* both verify the same code, the difference is the run */
+    Measure("verify and run, plain", 200, [&]() {
+        VM::VM vm;
+        vm.Execute(program.value.instructions, program.value.symbols);
+    });
+    Measure("verify, fuse and run", 200, [&]() {
+        VM::VM vm(true);
+        vm.Execute(program.value.instructions, program.value.symbols);
+    });
+    /* the run alone, on vms loaded beforehand */
+    for (bool fuse: { false, true }) {
+        std::vector<std::unique_ptr<VM::VM>> vms;
+        for (int i = 0; i < 200; i++) {
+            vms.emplace_back(new VM::VM(fuse));
+            vms.back()->Load(program.value.instructions, program.value.symbols);
+        }
+        size_t next = 0;
+        Measure(fuse ? "run, fused" : "run, plain", 200, [&]() {
+            vms[next++]->Resume(1L << 40);
+        });
+    }
+    /* fused once, for every vm */
+    VM::ImagePtr image = VM::Image::Make(program.value.instructions, program.value.symbols);
+    VM::VM vm;
+    Measure("run a shared image", 200, [&]() {
+        vm.Execute(image);
+    });
+    printf("\n");
+}
+
+void BenchSimd() {
+    printf("-----simd bench-----\n");
+    const size_t n = 1 << 16;
+    GC::Heap heap;
+    GC::Array* x = heap.Allocate(GetId("double"), n);
+    GC::Array* y = heap.Allocate(GetId("double"), n);
+    for (size_t i = 0; i < n; i++) {
+        x->data[i].d = i % 100 * 0.5;
+        y->data[i].d = 1.0;
+    }
+    Simd::Level best = Simd::Current();
+    Simd::Level levels[] = { Simd::kScalar, Simd::kSse2, Simd::kAvx2 };
+    const char* names[] = { "scalar", "sse2", "avx2" };
+    volatile double sink = 0;
+    for (int l = 0; l < 3; l++) {
+        if (!Simd::Supported(levels[l]))
+            continue;
+        Simd::Current() = levels[l];
+        std::string name = std::string("sum of 65536 doubles, ") + names[l];
+        Measure(name.c_str(), 200, [&]() {
+            sink = Simd::Reduce<Simd::kAdd>(true, x->data, n).d;
+        });
+        name = std::string("dot of 65536 doubles, ") + names[l];
+        Measure(name.c_str(), 200, [&]() {
+            sink = Simd::Dot(true, x->data, y->data, n).d;
+        });
+        name = std::string("axpy of 65536 doubles, ") + names[l];
+        Measure(name.c_str(), 200, [&]() {
+            Simd::Axpy(true, GC::Element{0}, x->data, y->data, n);
+        });
+    }
+    Simd::Current() = best;
+
+    /* the builtin against the statements summing one element each */
+    const int count = 1000;
+    Evaluator eval;
+    eval.Evaluate("double[" + std::to_string(count) + "] a;\n");
+    std::string loop = "{ s = 0; ";
+    for (int i = 0; i < count; i++)
+        loop += "s = s + a[" + std::to_string(i) + "]; ";
+    loop += "}\n";
+    Measure("sum(a) of 1000, evaluated", 200, [&]() {
+        eval.Evaluate("s = sum(a);\n");
+    });
+    Measure("s = s + a[i] of 1000, evaluated", 20, [&]() {
+        eval.Evaluate(loop);
+    });
+    (void)sink;
+    printf("\n");
+}
+
+int main()
+{
+    BenchParser();
+    BenchCompile();
+    BenchBytecode();
+    BenchArchive();
+    BenchCache();
+    BenchPool();
+    BenchEvaluation();
+    BenchScheduler();
+    BenchImage();
+    BenchFuse();
+    BenchSimd();
+    return 0;
+}
@@ -0,0 +1,245 @@
+/**
+ * A dense form of the instruction table.
+ * Every instruction takes 8 bytes in the table, though most of them have a small
+ * operand or none at all, so here the opcode is one byte and the operand follows
+ * in as few bytes as it needs: LEB128 for values and slots, 4 bytes for a jump,
+ * which keeps the size of every instruction known before the targets are.
+ * The vm runs this form directly, see VM::Execute.
+ */
+
+#ifndef BYTECODE_HPP
+#define BYTECODE_HPP
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "opcode.hpp"
+
+namespace CS {
+    namespace Bytecode {
+        using std::vector;
+        using OpCode::InstructionTable;
+        using OpCode::MakeOpCode;
+        using OpCode::SplitOpCode;
+
+        typedef vector<uint8_t> Code;
+
+        enum Operand {
+            kNone,
+            kSigned, // LEB128, sign extended
+            kUnsigned, // LEB128
+            kJump, // 4 bytes, little endian, from the end of the instruction
+            kInvalid
+        };
+
+        static Operand OperandOf(int op) {
+            switch (op) {
+                case 2: case 20: case 21: case 22: case 23: case 32:
+                    return kNone;
+                case 1:
+                    return kSigned;
+                case 3: case 4: case 5: case 30:
+                    return kUnsigned;
+                case 31:
+                    return kJump;
+                default:
+                    return kInvalid;
+            }
+        }
+
+        static size_t Size(int op, int val) {
+            switch (OperandOf(op)) {
+                case kNone:
+                    return 1;
+                case kJump:
+                    return 5;
+                case kSigned: {
+                    size_t size = 2;
+                    for (int64_t v = val; v < -64 || v > 63; v >>= 7)
+                        ++size;
+                    return size;
+                }
+                default: {
+                    size_t size = 2;
+                    for (uint32_t v = val; v > 127; v >>= 7)
+                        ++size;
+                    return size;
+                }
+            }
+        }
+
+        static void WriteSigned(Code& code, int val) {
+            int64_t v = val;
+            while (v < -64 || v > 63) {
+                code.push_back(static_cast<uint8_t>(v & 0x7f) | 0x80);
+                v >>= 7;
+            }
+            code.push_back(static_cast<uint8_t>(v & 0x7f));
+        }
+
+        static void WriteUnsigned(Code& code, int val) {
+            uint32_t v = val;
+            while (v > 127) {
+                code.push_back(static_cast<uint8_t>(v & 0x7f) | 0x80);
+                v >>= 7;
+            }
+            code.push_back(static_cast<uint8_t>(v));
+        }
+
+        /* the readers trust the code, Decode is the one checking it */
+        inline int ReadSigned(const uint8_t*& p) {
+            int64_t v = 0;
+            int shift = 0;
+            uint8_t byte;
+            do {
+                byte = *p++;
+                v |= static_cast<int64_t>(byte & 0x7f) << shift;
+                shift += 7;
+            } while (byte & 0x80);
+            if (shift < 64 && (byte & 0x40))
+                v |= -(static_cast<int64_t>(1) << shift);
+            return static_cast<int>(v);
+        }
+
+        inline int ReadUnsigned(const uint8_t*& p) {
+            if (*p < 0x80)
+                return *p++;
+            uint32_t v = 0;
+            int shift = 0;
+            uint8_t byte;
+            do {
+                byte = *p++;
+                v |= static_cast<uint32_t>(byte & 0x7f) << shift;
+                shift += 7;
+            } while (byte & 0x80);
+            return static_cast<int>(v);
+        }
+
+        inline int ReadJump(const uint8_t*& p) {
+            uint32_t v = p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+            p += 4;
+            return static_cast<int32_t>(v);
+        }
+
+        /*
+         * 'code' gets the dense form of 'ins_tbl', and 'offsets' if given the byte
+         * where each instruction starts, plus the end. False on an unknown opcode
+         * or a jump out of the table, which the verifier refuses anyway.
+         */
+        static bool Encode(const InstructionTable& ins_tbl, Code& code,
+                vector<uint32_t>* offsets = nullptr) {
+            const int count = ins_tbl.size();
+            vector<uint32_t> starts(count + 1, 0);
+            for (int i = 0; i < count; i++) {
+                std::pair<int, int> op_val = SplitOpCode(ins_tbl[i]);
+                if (OperandOf(op_val.first) == kInvalid)
+                    return false;
+                starts[i + 1] = starts[i] + Size(op_val.first, op_val.second);
+            }
+            code.clear();
+            code.reserve(starts[count]);
+            for (int i = 0; i < count; i++) {
+                std::pair<int, int> op_val = SplitOpCode(ins_tbl[i]);
+                int op = op_val.first;
+                int val = op_val.second;
+                code.push_back(static_cast<uint8_t>(op));
+                switch (OperandOf(op)) {
+                    case kSigned:
+                        WriteSigned(code, val);
+                        break;
+                    case kUnsigned:
+                        WriteUnsigned(code, val);
+                        break;
+                    case kJump: {
+                        long long target = static_cast<long long>(i) + 1 + val;
+                        if (target < 0 || target > count)
+                            return false;
+                        uint32_t delta = starts[target] - starts[i + 1];
+                        for (int b = 0; b < 4; b++)
+                            code.push_back(static_cast<uint8_t>(delta >> (8 * b)));
+                        break;
+                    }
+                    default:
+                        break;
+                }
+            }
+            if (offsets)
+                offsets->swap(starts);
+            return true;
+        }
+
+        /* the table 'code' was made from, false if it is not well formed */
+        static bool Decode(const Code& code, InstructionTable& ins_tbl,
+                vector<uint32_t>* offsets = nullptr) {
+            vector<uint32_t> starts;
+            vector<std::pair<int, int> > instructions;
+            const uint8_t* begin = code.data();
+            const uint8_t* end = begin + code.size();
+            const uint8_t* p = begin;
+            while (p < end) {
+                starts.push_back(p - begin);
+                int op = *p++;
+                int val = 0;
+                Operand operand = OperandOf(op);
+                if (operand == kInvalid)
+                    return false;
+                if (operand == kJump) {
+                    if (end - p < 4)
+                        return false;
+                    val = ReadJump(p);
+                } else if (operand != kNone) {
+                    /* at most 5 bytes, the last one ending the number */
+                    const uint8_t* last = p;
+                    while (last < end && last - p < 5 && (*last & 0x80))
+                        ++last;
+                    if (last == end || last - p == 5)
+                        return false;
+                    val = operand == kSigned ? ReadSigned(p) : ReadUnsigned(p);
+                }
+                instructions.emplace_back(op, val);
+            }
+            starts.push_back(code.size());
+            /* a jump in bytes becomes a jump in instructions, and must land on one */
+            ins_tbl.clear();
+            for (size_t i = 0; i < instructions.size(); i++) {
+                int op = instructions[i].first;
+                int val = instructions[i].second;
+                if (OperandOf(op) == kJump) {
+                    long long target = static_cast<long long>(starts[i + 1]) + val;
+                    auto found = std::lower_bound(starts.begin(), starts.end(), target);
+                    if (target < 0 || found == starts.end() || *found != target)
+                        return false;
+                    val = static_cast<int>(found - starts.begin()) - static_cast<int>(i) - 1;
+                }
+                ins_tbl.push_back(MakeOpCode(op, val));
+            }
+            if (offsets)
+                offsets->swap(starts);
+            return true;
+        }
+
+        /* the instruction starting at byte 'offset' of well formed code */
+        static int Index(const Code& code, size_t offset) {
+            const uint8_t* p = code.data();
+            const uint8_t* end = p + offset;
+            int index = 0;
+            for (; p < end; ++index) {
+                switch (OperandOf(*p++)) {
+                    case kSigned:
+                        ReadSigned(p);
+                        break;
+                    case kUnsigned:
+                        ReadUnsigned(p);
+                        break;
+                    case kJump:
+                        p += 4;
+                        break;
+                    default:
+                        break;
+                }
+            }
+            return index;
+        }
+    }
+}
+#endif
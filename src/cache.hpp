@@ -0,0 +1,188 @@
+/**
+ * Compiled scripts kept on disk next to their source, as 'script.cs' and 'script.cs.csc'.
+ * A cache holds the program of one exact source under one version of the compiler,
+ * checked by the size and FNV-1a hash of the source and by the version, so a run of an
+ * unchanged script reads the cache and goes straight to the vm. Anything else compiles
+ * again and rewrites the cache; a cache is never trusted past those checks and its own checksum.
+ *
+ * "CSCC", compiler version, source size (u64), source hash (u64), checksum, payload size,
+ * payload: the symbols, the instructions (u64 each), the sources (pc and offset)
+ */
+
+#ifndef CACHE_HPP
+#define CACHE_HPP
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include "diagnostic.hpp"
+#include "strings.hpp"
+#include "compiler.hpp"
+#include "archive.hpp"
+
+namespace CS {
+    namespace Cache {
+        using std::string;
+        using Archive::Buffer;
+        using Archive::Cursor;
+        using Compiler::Program;
+
+        const char kMagic[] = "CSCC";
+        const size_t kHead = 32;
+
+        static string CachePath(const string& source_path) {
+            return source_path + ".csc";
+        }
+
+        /* the whole file, false if it cannot be read */
+        static bool ReadFile(const string& path, string& data) {
+            FILE* input = fopen(path.c_str(), "rb");
+            if (input == nullptr)
+                return false;
+            data.clear();
+            char buffer[1 << 16];
+            size_t size;
+            while ((size = fread(buffer, 1, sizeof(buffer), input)) > 0)
+                data.append(buffer, size);
+            bool ok = !ferror(input);
+            fclose(input);
+            return ok;
+        }
+
+        static uint32_t Checksum(const uint8_t* data, size_t size) {
+            uint32_t hash = 2166136261u;
+            for (size_t i = 0; i < size; i++) {
+                hash ^= data[i];
+                hash *= 16777619u;
+            }
+            return hash;
+        }
+
+        /*
+         * Write to a file of its own and rename it, so a reader never sees half a cache.
+         * The file is named after the process and the thread, so writers never share one.
+         */
+        static bool Store(const string& cache_path, const string& source, const Program& program) {
+            Buffer payload;
+            Archive::Put32(payload, program.symbols.size());
+            for (auto& i: program.symbols) {
+                Archive::PutString(payload, i.first);
+                Archive::Put32(payload, i.second);
+            }
+            Archive::Put32(payload, program.instructions.size());
+            for (long long instruction: program.instructions)
+                Archive::Put64(payload, instruction);
+            Archive::Put32(payload, program.sources.size());
+            for (auto& i: program.sources) {
+                Archive::Put32(payload, i.first);
+                Archive::Put32(payload, i.second);
+            }
+            Buffer head(kMagic, kMagic + 4);
+            Archive::Put32(head, Compiler::kVersion);
+            Archive::Put64(head, source.size());
+            Archive::Put64(head, Strings::Hash(source.data(), source.size()));
+            Archive::Put32(head, Checksum(payload.data(), payload.size()));
+            Archive::Put32(head, payload.size());
+
+            string temp = cache_path + "." + std::to_string(getpid()) + "." +
+                std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+            FILE* output = fopen(temp.c_str(), "wb");
+            if (output == nullptr)
+                return false;
+            bool ok = fwrite(head.data(), 1, head.size(), output) == head.size() &&
+                fwrite(payload.data(), 1, payload.size(), output) == payload.size();
+            ok = fclose(output) == 0 && ok;
+            if (!ok || rename(temp.c_str(), cache_path.c_str()) != 0) {
+                remove(temp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        /* the program cached for exactly 'source', false on any mismatch */
+        static bool Load(const string& cache_path, const string& source, Program& program) {
+            string data;
+            if (!ReadFile(cache_path, data) || data.size() < kHead ||
+                    memcmp(data.data(), kMagic, 4) != 0)
+                return false;
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.data());
+            Cursor head(bytes + 4, kHead - 4);
+            uint32_t version = 0, checksum = 0, size = 0;
+            uint64_t source_size = 0, source_hash = 0;
+            head.Get32(version);
+            head.Get64(source_size);
+            head.Get64(source_hash);
+            head.Get32(checksum);
+            head.Get32(size);
+            /* the cheap checks first, the hash of the source last */
+            if (version != Compiler::kVersion || source_size != source.size() ||
+                    size != data.size() - kHead ||
+                    Checksum(bytes + kHead, size) != checksum ||
+                    source_hash != Strings::Hash(source.data(), source.size()))
+                return false;
+
+            Program loaded;
+            Cursor payload(bytes + kHead, size);
+            uint32_t count;
+            if (!payload.Get32(count))
+                return false;
+            for (uint32_t i = 0; i < count; i++) {
+                string symbol;
+                uint32_t index;
+                if (!payload.GetString(symbol) || !payload.Get32(index))
+                    return false;
+                loaded.symbols.emplace(symbol, static_cast<int>(index));
+            }
+            if (!payload.Get32(count) || count > payload.Left() / 8)
+                return false;
+            loaded.instructions.reserve(count);
+            for (uint32_t i = 0; i < count; i++) {
+                uint64_t instruction = 0;
+                payload.Get64(instruction);
+                loaded.instructions.push_back(static_cast<long long>(instruction));
+            }
+            if (!payload.Get32(count) || count > payload.Left() / 8)
+                return false;
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t pc = 0, offset = 0;
+                payload.Get32(pc);
+                payload.Get32(offset);
+                loaded.sources.emplace_back(static_cast<int>(pc), static_cast<int>(offset));
+            }
+            if (payload.Left() != 0)
+                return false;
+            program = std::move(loaded);
+            return true;
+        }
+
+        /*
+         * Compile the script at 'source_path', or take it from its cache.
+         * Only a program which compiled without diagnostics is cached. 'hit' tells which it was.
+         */
+        static Result<Program> CompileFile(const string& source_path, bool* hit = nullptr) {
+            Result<Program> result;
+            if (hit)
+                *hit = false;
+            string source;
+            if (!ReadFile(source_path, source)) {
+                Report(&result.diagnostics, -1, "cannot read " + source_path);
+                return result;
+            }
+            string cache_path = CachePath(source_path);
+            if (Load(cache_path, source, result.value)) {
+                if (hit)
+                    *hit = true;
+                return result;
+            }
+            result = Compiler::Compile(source);
+            if (result.Ok())
+                Store(cache_path, source, result.value);
+            return result;
+        }
+    }
+}
+#endif
@@ -0,0 +1,202 @@
+/**
+ * The whole front end in one call: scan, parse and encode a script.
+ * Every stage goes on after an error, so all the diagnostics of a script come back at once.
+ */
+
+#ifndef COMPILER_HPP
+#define COMPILER_HPP
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "diagnostic.hpp"
+#include "scanner.hpp"
+#include "parser.hpp"
+#include "encoder.hpp"
+
+namespace CS {
+    namespace Compiler {
+        using OpCode::InstructionTable;
+        using OpCode::SymbolTable;
+        using OpCode::SourceTable;
+        using OpCode::SplitOpCode;
+        using OpCode::MakeOpCode;
+
+        /* changes whenever the same source may compile to other instructions, see cache.hpp */
+        const uint32_t kVersion = 1;
+
+        struct Program {
+            InstructionTable instructions;
+            SymbolTable symbols;
+            SourceTable sources;
+        };
+
+        /* the program is only meant to be run when the result is Ok */
+        static Result<Program> Compile(const char* code) {
+            CS_TRACE_SCOPE("compile");
+            Result<Program> result;
+            TokenList token_list = Scanner::Scan(code, &result.diagnostics);
+            Parser parser;
+            std::shared_ptr<SyntaxTree> tree(parser.Parse(token_list, &result.diagnostics));
+            Encoder::Encoder encoder;
+            auto instruction_symbol = encoder.Encode(tree.get(), &result.diagnostics);
+            result.value.instructions = *instruction_symbol.first;
+            result.value.symbols = *instruction_symbol.second;
+            result.value.sources = encoder.Sources();
+            return result;
+        }
+
+        static Result<Program> Compile(const std::string& code) {
+            return Compile(code.c_str());
+        }
+
+        /* a run of statements compiled on its own, with slots and symbols of its own */
+        struct Chunk {
+            Program program;
+            Encoder::RelocationTable relocations;
+            Encoder::Context variables;
+            int slots;
+            Diagnostics diagnostics;
+        };
+
+        /*
+         * Append the chunks in order. Slots of local variables move up by the slots of the chunks before,
+         * variables of earlier chunks are filled in from the relocations, and call indices
+         * are renumbered in order of first use, so the result equals a sequential Compile.
+         * Jumps are relative and need nothing.
+         */
+        static void Link(std::vector<Chunk>& chunks, Result<Program>& result) {
+            Program& program = result.value;
+            Encoder::Context globals;
+            int base = 0;
+
+            for (auto& chunk: chunks) {
+                result.diagnostics.insert(result.diagnostics.end(),
+                        chunk.diagnostics.begin(), chunk.diagnostics.end());
+                int code_base = program.instructions.size();
+
+                std::vector<std::string> names(chunk.program.symbols.size() + 1);
+                for (auto& i: chunk.program.symbols)
+                    names[i.second] = i.first;
+                std::vector<int> calls(names.size(), 0);
+                for (size_t i = 1; i < names.size(); i++) {
+                    int index = program.symbols.size() + 1;
+                    calls[i] = program.symbols.emplace(names[i], index).first->second;
+                }
+
+                for (long long instruction: chunk.program.instructions) {
+                    std::pair<int, int> op_val = SplitOpCode(instruction);
+                    int op = op_val.first;
+                    int val = op_val.second;
+                    /* mov, load */
+                    if (op == 3 || op == 4)
+                        val += base;
+                    /* call */
+                    else if (op == 30)
+                        val = calls[val];
+                    program.instructions.push_back(MakeOpCode(op, val));
+                }
+
+                for (auto& relocation: chunk.relocations) {
+                    auto slot = globals.find(relocation.id);
+                    if (slot == globals.end()) {
+                        Report(&result.diagnostics, relocation.offset,
+                                "undefined variable: " + relocation.id);
+                        continue;
+                    }
+                    long long& instruction = program.instructions[code_base + relocation.pc];
+                    instruction = MakeOpCode(SplitOpCode(instruction).first, slot->second);
+                }
+
+                for (auto& source: chunk.program.sources)
+                    program.sources.emplace_back(code_base + source.first, source.second);
+
+                /* a redeclaration hides the variable before it, as it does in one chunk */
+                for (auto& variable: chunk.variables)
+                    globals[variable.first] = base + variable.second;
+                base += chunk.slots;
+            }
+        }
+
+        /*
+         * Split the script after every 'chunk_size' statements into chunks, scan, parse and encode
+         * them on 'threads' threads (0 for one per core), then link them into one program.
+         */
+        static Result<Program> CompileParallel(const char* code, int threads = 0,
+                size_t chunk_size = 256) {
+            Result<Program> result;
+
+            /* chunk i is the source in [bounds[i], bounds[i+1]) */
+            std::vector<size_t> bounds(1, 0);
+            size_t statements = 0;
+            size_t size = 0;
+            int nesting = 0;
+            bool quoted = false;
+            for (; code[size] != '\0'; size++) {
+                char ch = code[size];
+                /* what a string holds is no statement, see Scanner::Scan */
+                if (quoted) {
+                    if (ch == '\\' && code[size + 1] != '\0')
+                        ++size;
+                    else if (ch == '"')
+                        quoted = false;
+                    continue;
+                }
+                if (ch == '"')
+                    quoted = true;
+                else if (ch == '{')
+                    ++nesting;
+                else if (ch == '}')
+                    --nesting;
+                /* a block is never split, and ends like a statement */
+                if ((ch == ';' || ch == '}') && nesting == 0 &&
+                        ++statements % chunk_size == 0)
+                    bounds.push_back(size + 1);
+            }
+            if (bounds.back() != size)
+                bounds.push_back(size);
+
+            std::vector<Chunk> chunks(bounds.size() - 1);
+            std::atomic<size_t> next(0);
+            auto work = [&]() {
+                Parser parser;
+                for (size_t i; (i = next++) < chunks.size(); ) {
+                    CS_TRACE_SCOPE("compile chunk");
+                    Chunk& chunk = chunks[i];
+                    TokenList token_list = Scanner::Scan(code, bounds[i], bounds[i + 1],
+                            &chunk.diagnostics);
+                    std::shared_ptr<SyntaxTree> tree(parser.Parse(token_list, &chunk.diagnostics));
+                    Encoder::Encoder encoder(true);
+                    auto instruction_symbol = encoder.Encode(tree.get(), &chunk.diagnostics);
+                    chunk.program.instructions = *instruction_symbol.first;
+                    chunk.program.symbols = *instruction_symbol.second;
+                    chunk.program.sources = encoder.Sources();
+                    chunk.relocations = encoder.Relocations();
+                    chunk.variables = encoder.Variables();
+                    chunk.slots = encoder.Depth();
+                }
+            };
+
+            if (threads <= 0)
+                threads = std::max(1u, std::thread::hardware_concurrency());
+            std::vector<std::thread> pool;
+            for (int i = 1; i < threads; i++)
+                pool.emplace_back(work);
+            work();
+            for (auto& thread: pool)
+                thread.join();
+
+            Link(chunks, result);
+            return result;
+        }
+
+        inline Result<Program> CompileParallel(const std::string& code, int threads = 0,
+                size_t chunk_size = 256) {
+            return CompileParallel(code.c_str(), threads, chunk_size);
+        }
+    }
+}
+#endif
@@ -0,0 +1,145 @@
+/**
+ * A byte compressor in the manner of the LZ4 block format.
+ * The input is a run of sequences, each a token whose high nibble is the count of literals
+ * and low nibble the length of the match less 4, 15 meaning more bytes of 255 follow,
+ * then the literals, then the match as a 2 byte offset back into the output.
+ * The last sequence has literals only. Matches are found with one hash probe,
+ * so it is fast rather than tight, which suits code read once at load.
+ */
+
+#ifndef COMPRESS_HPP
+#define COMPRESS_HPP
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace CS {
+    namespace Compress {
+        using std::vector;
+
+        const size_t kMinMatch = 4;
+        const size_t kLastLiterals = 5; // the end of the input is never in a match
+        const size_t kMaxOffset = 65535;
+        const int kHashBits = 12;
+
+        /* the most 'src_size' bytes decompress to, a length byte stands for 255 at most */
+        inline size_t MaxDecompressed(size_t src_size) {
+            return src_size * 255 + 64;
+        }
+
+        inline uint32_t Read32(const uint8_t* p) {
+            uint32_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline void WriteLength(vector<uint8_t>& out, size_t length) {
+            for (; length >= 255; length -= 255)
+                out.push_back(255);
+            out.push_back(static_cast<uint8_t>(length));
+        }
+
+        /* one sequence, 'match' is 0 for the last one */
+        inline void WriteSequence(vector<uint8_t>& out, const uint8_t* literals, size_t count,
+                size_t offset, size_t match) {
+            size_t extra = match ? match - kMinMatch : 0;
+            out.push_back(static_cast<uint8_t>((count < 15 ? count : 15) << 4 | (extra < 15 ? extra : 15)));
+            if (count >= 15)
+                WriteLength(out, count - 15);
+            out.insert(out.end(), literals, literals + count);
+            if (!match)
+                return;
+            out.push_back(static_cast<uint8_t>(offset));
+            out.push_back(static_cast<uint8_t>(offset >> 8));
+            if (extra >= 15)
+                WriteLength(out, extra - 15);
+        }
+
+        static vector<uint8_t> Compress(const uint8_t* src, size_t size) {
+            vector<uint8_t> out;
+            out.reserve(size / 2 + 16);
+            /* positions plus one of the last sequence seen with each hash, 0 for none */
+            vector<uint32_t> table(1 << kHashBits, 0);
+            size_t anchor = 0;
+            size_t i = 0;
+            size_t limit = size > kLastLiterals + kMinMatch + 3 ? size - kLastLiterals - kMinMatch - 3 : 0;
+            while (i < limit) {
+                uint32_t sequence = Read32(src + i);
+                uint32_t hash = (sequence * 2654435761u) >> (32 - kHashBits);
+                size_t candidate = table[hash];
+                table[hash] = i + 1;
+                if (candidate == 0 || i - (candidate - 1) > kMaxOffset ||
+                        Read32(src + candidate - 1) != sequence) {
+                    ++i;
+                    continue;
+                }
+                size_t from = candidate - 1;
+                size_t length = kMinMatch;
+                while (i + length < size - kLastLiterals && src[from + length] == src[i + length])
+                    ++length;
+                WriteSequence(out, src + anchor, i - anchor, i - from, length);
+                i += length;
+                anchor = i;
+            }
+            WriteSequence(out, src + anchor, size - anchor, 0, 0);
+            return out;
+        }
+
+        static vector<uint8_t> Compress(const vector<uint8_t>& src) {
+            return Compress(src.data(), src.size());
+        }
+
+        /* the bytes extending a length, false when they run past the input */
+        static bool ReadLength(const uint8_t*& p, const uint8_t* end, size_t& length) {
+            uint8_t byte;
+            do {
+                if (p == end)
+                    return false;
+                byte = *p++;
+                length += byte;
+            } while (byte == 255);
+            return true;
+        }
+
+        /*
+         * 'out' gets exactly 'size' bytes, or false when the input is malformed:
+         * a length past either end, or a match before the start of the output.
+         */
+        static bool Decompress(const uint8_t* src, size_t src_size, vector<uint8_t>& out,
+                size_t size) {
+            out.resize(size);
+            const uint8_t* p = src;
+            const uint8_t* end = src + src_size;
+            size_t o = 0;
+            while (p < end) {
+                uint8_t token = *p++;
+                size_t count = token >> 4;
+                if (count == 15 && !ReadLength(p, end, count))
+                    return false;
+                if (count > static_cast<size_t>(end - p) || count > size - o)
+                    return false;
+                if (count)
+                    memcpy(out.data() + o, p, count);
+                p += count;
+                o += count;
+                if (p == end)
+                    break;
+                if (end - p < 2)
+                    return false;
+                size_t offset = p[0] | p[1] << 8;
+                p += 2;
+                size_t length = token & 15;
+                if (length == 15 && !ReadLength(p, end, length))
+                    return false;
+                length += kMinMatch;
+                if (offset == 0 || offset > o || length > size - o)
+                    return false;
+                /* byte by byte, the match may overlap what it writes */
+                for (size_t i = 0; i < length; i++, o++)
+                    out[o] = out[o - offset];
+            }
+            return o == size;
+        }
+    }
+}
+#endif
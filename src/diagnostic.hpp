@@ -0,0 +1,42 @@
+/**
+ * Errors found while compiling. Every stage records them and carries on
+ * with the next statement, so a script is checked in one pass.
+ */
+
+#ifndef DIAGNOSTIC_HPP
+#define DIAGNOSTIC_HPP
+#include <string>
+#include <vector>
+#include <iostream>
+
+namespace CS {
+    using std::string;
+
+    struct Diagnostic {
+        int offset; // byte offset in the source, -1 if unknown
+        string message;
+    };
+
+    typedef std::vector<Diagnostic> Diagnostics;
+
+    template <typename T>
+    struct Result {
+        T value;
+        Diagnostics diagnostics;
+
+        bool Ok() const {
+            return diagnostics.empty();
+        }
+    };
+
+    /* without a list to collect into, the diagnostic is printed */
+    static void Report(Diagnostics* diagnostics, int offset, const string& message) {
+        if (diagnostics) {
+            Diagnostic diagnostic = { offset, message };
+            diagnostics->push_back(diagnostic);
+        } else {
+            std::cerr << message << std::endl;
+        }
+    }
+}
+#endif
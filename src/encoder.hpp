@@ -9,33 +9,119 @@
 
 #include "parser.hpp"
 #include "opcode.hpp"
+#include "diagnostic.hpp"
 
 namespace CS {
     namespace Encoder {
         using OpCode::InstructionTable;
         using OpCode::SymbolTable;
+        using OpCode::SourceTable;
         using OpCode::StackModel;
 
         typedef std::unordered_map<std::string, int> Context;
 
+        /* an instruction whose operand is the slot of a variable declared elsewhere */
+        struct Relocation {
+            int pc;
+            std::string id;
+            int offset;
+        };
+        typedef std::vector<Relocation> RelocationTable;
+
         class Encoder {
 
             public:
-                Encoder(): stack_() {}
+                /*
+                 * A relocatable encoder leaves unknown variables to the linker,
+                 * see Compiler::CompileParallel.
+                 */
+                Encoder(bool relocatable = false): stack_(), context_(), mark_(),
+                    diagnostics_(nullptr), failed_(false), relocatable_(relocatable) {}
 
                 ~Encoder() {}
 
+                /* a statement with an error is reported and encodes nothing */
                 std::pair<InstructionTable*, SymbolTable*>
-                Encode(SyntaxTree* syntax_tree) {
+                Encode(SyntaxTree* syntax_tree, Diagnostics* diagnostics = nullptr) {
+                    CS_TRACE_SCOPE("encode");
+                    diagnostics_ = diagnostics;
                     BlockEvaluate(syntax_tree);
+                    CS_TRACE_COUNT("instructions", stack_.Size());
                     return stack_.Export();
                 }
 
+                /*
+                 * Encode more code against the variables encoded so far,
+                 * and return only the new instructions, for a vm which keeps running.
+                 */
+                InstructionTable Append(SyntaxTree* syntax_tree, Diagnostics* diagnostics = nullptr) {
+                    CS_TRACE_SCOPE("encode");
+                    mark_.size = stack_.Size();
+                    mark_.depth = stack_.Depth();
+                    mark_.symbols = stack_.Symbols();
+                    mark_.declared.clear();
+                    diagnostics_ = diagnostics;
+                    BlockEvaluate(syntax_tree);
+                    InstructionTable* instructions = stack_.Export().first;
+                    CS_TRACE_COUNT("instructions", instructions->size() - mark_.size);
+                    return InstructionTable(instructions->begin() + mark_.size,
+                            instructions->end());
+                }
+
+                /* forget the last Append, e.g. when the vm refused it */
+                void Rollback() {
+                    Truncate(mark_.size, mark_.depth, mark_.symbols);
+                    /* latest first, for a name declared twice */
+                    for (auto i = mark_.declared.rbegin(); i != mark_.declared.rend(); ++i) {
+                        if (i->second < 0)
+                            context_.erase(i->first);
+                        else
+                            context_[i->first] = i->second;
+                    }
+                    mark_.declared.clear();
+                }
+
+                /* emitted alongside the instructions, see source.hpp */
+                const SourceTable& Sources() const {
+                    return sources_;
+                }
+
+                const RelocationTable& Relocations() const {
+                    return relocations_;
+                }
+
+                /* slots taken by the variables so far */
+                int Depth() const {
+                    return stack_.Depth();
+                }
+
+                /* variables declared by the encoded code, and their slots */
+                const Context& Variables() const {
+                    return context_;
+                }
+
+                /* slot of a variable, or -1 */
+                int Slot(const std::string& id) const {
+                    auto slot = context_.find(id);
+                    return slot == context_.end() ? -1 : slot->second;
+                }
+
+                SymbolTable& Symbols() {
+                    return *stack_.Export().second;
+                }
+
 
             private:
                 void BlockEvaluate(SyntaxTree* tree) {
-                    Context context;
+                    Context& context = context_;
                     while (tree) {
+                        /* only declarations change the context, and they never fail */
+                        size_t size = stack_.Size();
+                        int depth = stack_.Depth();
+                        int symbols = stack_.Symbols();
+                        failed_ = false;
+                        sources_.emplace_back(size, Start(tree));
+
                         if (tree->type_ == 36 || tree->type_ == 37) {
                             Statement(tree, context);
                         } else if (tree->type_ == GetId("=")) {
@@ -49,9 +135,11 @@ namespace CS {
                         } else if (tree->type_ == GetId("for")) {
                             ForBlock(tree, context);
                         } else {
-                            std::cerr << "syntax error: " << tree->value_ << std::endl;
-                            exit(4);
+                            Error("syntax error: " + tree->value_, tree->offset_);
                         }
+
+                        if (failed_)
+                            Truncate(size, depth, symbols);
                         tree = tree->next_;
                     }
                 }
@@ -59,43 +147,69 @@ namespace CS {
                 void Statement(SyntaxTree* tree, Context& context) {
                     assert(tree->type_ == 36 ||
                             tree->type_ == 37);
-                    /* int type */
-                    int pos = 0;
-                    if (tree->type_ == 36) {
-                        pos = stack_.Action("alloc", 4);
-                    /* double type */
-                    } else if (tree->type_ == 37) {
-                        pos = stack_.Action("alloc", 8);
+                    if (tree->right_) {
+                        Error("unsupported value: array " + tree->left_->value_, tree->offset_);
+                        return;
                     }
-                    context.emplace(tree->value_, pos);
+                    /* a slot holds an int, a double would be truncated */
+                    if (tree->type_ == 37) {
+                        Error("unsupported value: double " + tree->left_->value_, tree->offset_);
+                        return;
+                    }
+                    /* the variable starts at the current top of stack, and hides one of the same name */
+                    int pos = stack_.Depth();
+                    stack_.Action("alloc", 4);
+                    /* what Rollback restores */
+                    const std::string& name = tree->left_->value_;
+                    auto hidden = context.find(name);
+                    mark_.declared.emplace_back(name, hidden == context.end() ? -1 : hidden->second);
+                    context[name] = pos;
                 }
 
                 void Assignment(SyntaxTree* tree, Context& context) {
                     assert(tree->type_ == GetId("="));
+                    if (tree->left_->type_ != GetId("identifier_type")) {
+                        Error("unsupported assignment to " + tree->left_->value_, tree->offset_);
+                        return;
+                    }
                     Expression(tree->right_, context);
-                    stack_.Action("mov", context[tree->value_]);
+                    stack_.Action("mov", Address(tree->left_, context));
                     stack_.Action("pop");
                 }
 
                 void Call(SyntaxTree* tree, Context& context) {
                     TokenNode* args = tree->right_;
+                    int argc = 0;
                     while (args) {
                         Expression(args, context);
                         args = args->next_;
+                        ++argc;
                     }
                     stack_.Action("call", tree->left_->value_.data());
+                    /* the caller cleans up the arguments */
+                    while (argc--)
+                        stack_.Action("pop");
                 }
 
                 void Expression(SyntaxTree* tree, Context& context) {
                     if (tree->left_ == nullptr && tree->right_ == nullptr) {
-                        if (tree->type_ == GetId("int") ||
-                            tree->type_ == GetId("double")) {
+                        if (tree->type_ == GetId("int")) {
                             stack_.Action("push", std::stoi(tree->value_));
                         } else if (tree->type_ == GetId("identifier_type")){
-                            stack_.Action("load", context[tree->value_]);
+                            stack_.Action("load", Address(tree, context));
+                        } else if (tree->type_ == GetId("double")) {
+                            /* the stack holds ints only */
+                            Error("unsupported value: " + tree->value_, tree->offset_);
+                        } else {
+                            Error("unsupported value: \"" + tree->value_ + "\"", tree->offset_);
                         }
                     } else if (tree->type_ == GetId("call_type")) {
                         Call(tree, context);
+                    } else if (tree->left_ == nullptr) {
+                        /* unary minus, 0 - x */
+                        stack_.Action("push", 0);
+                        Expression(tree->right_, context);
+                        stack_.Action("sub");
                     } else {
                         Expression(tree->left_, context);
                         Expression(tree->right_, context);
@@ -113,9 +227,8 @@ namespace CS {
                                 stack_.Action("div");
                                 break;
                             default:
-                                assert(false);
+                                Error("unsupported operator: " + tree->value_, tree->offset_);
                         }
-                        stack_.Action("pop");
                     }
                 }
 
@@ -134,7 +247,56 @@ namespace CS {
 
                 }
 
+                int Address(TokenNode* id, Context& context) {
+                    auto slot = context.find(id->value_);
+                    if (slot == context.end() && relocatable_) {
+                        Relocation relocation = { static_cast<int>(stack_.Size()), id->value_, id->offset_ };
+                        relocations_.push_back(relocation);
+                        return 0;
+                    } else if (slot == context.end()) {
+                        Error("undefined variable: " + id->value_, id->offset_);
+                        return 0;
+                    }
+                    return slot->second;
+                }
+
+                /* where a statement starts: its leftmost token */
+                int Start(SyntaxTree* tree) {
+                    while (tree->left_)
+                        tree = tree->left_;
+                    return tree->offset_;
+                }
+
+                void Truncate(size_t size, int depth, int symbols) {
+                    stack_.Truncate(size, depth, symbols);
+                    while (!sources_.empty() && sources_.back().first >= static_cast<int>(size))
+                        sources_.pop_back();
+                    while (!relocations_.empty() && relocations_.back().pc >= static_cast<int>(size))
+                        relocations_.pop_back();
+                }
+
+                /* the statement being encoded is dropped once it is done */
+                void Error(const std::string& message, int offset) {
+                    Report(diagnostics_, offset, message);
+                    failed_ = true;
+                }
+
+                struct Mark {
+                    size_t size;
+                    int depth;
+                    int symbols;
+                    /* the names declared since, with the slot each one hid, -1 if none */
+                    std::vector<std::pair<std::string, int>> declared;
+                };
+
                 StackModel stack_;
+                Context context_; // variable -> slot, kept across Append
+                Mark mark_;
+                SourceTable sources_;
+                RelocationTable relocations_;
+                Diagnostics* diagnostics_;
+                bool failed_; // an error is found in the current statement
+                bool relocatable_;
         };
     }
 }
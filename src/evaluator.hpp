@@ -9,80 +9,497 @@
 #define EVALUATOR_HPP
 #include <unordered_map>
 #include <memory>
+#include <set>
+#include <algorithm>
+#include <atomic>
 
 #include "scanner.hpp"
 #include "parser.hpp"
 #include "variable.hpp"
 #include "function.hpp"
+#include "snapshot.hpp"
 
 namespace CS {
     using std::shared_ptr;
     typedef std::unordered_map<std::string, Variable> Context;
 class Block {
     public:
-        Block(): context_(), up_(nullptr), down_(nullptr) {}
+        Block(): context_(), heap_(), locals_(), scopes_(), stamp_(0), version_(NextVersion()),
+            lookups_(0), pinned_(nullptr) {}
 
-        Block(Block* up, Block* down):
-            up_(up), down_(down) {
+        /* writes go through here, so memoized expressions see them */
+        void Assign(const string& id, const Variable& value) {
+            Slot(id) = value;
+            Touch(id);
+        }
+
+        void Touch(const string& id) {
+            written_[id] = ++stamp_;
+        }
+
+        /* the count of writes so far */
+        long Stamp() const {
+            return stamp_;
+        }
+
+        /* none of 'inputs' is written after 'stamp' */
+        bool Unchanged(const vector<string>& inputs, long stamp) const {
+            if (stamp == stamp_) return true;
+            for (auto& id: inputs) {
+                auto written = written_.find(id);
+                if (written != written_.end() && written->second > stamp)
+                    return false;
             }
+            return true;
+        }
 
 
         Variable& Retrieve(const string& id) {
-            return context_[id];
+            return Slot(id);
         }
 
         Variable& Retrieve(const char* id) {
-            return context_[id];
+            return Slot(id);
         }
 
         Variable& operator[] (const string& id) {
-            return context_[id];
+            return Slot(id);
         }
 
         Variable& operator[] (const char* id) {
-            return context_[id];
+            return Slot(id);
         }
 
-        /* return a function pointer */
+        /* return a function pointer, nullptr if there is none */
         FunPtr Load(const string& id) {
-            return fun_table_[id];
+            auto fun = fun_table_.find(id);
+            return fun == fun_table_.end() ? nullptr : fun->second;
+        }
+
+        /*
+         * Inline caches: an identifier keeps the global it was found to be, and a call
+         * the builtin it names, tagged with the version of the names of the block.
+         * Entries of the tables never move, so the cache holds until a name is added
+         * or removed, which takes a new version and sends every site back to the table.
+         */
+        Variable& Global(SyntaxTree* id) {
+            if (id->cache_version_ != version_) {
+                Variable* global = &Slot(id->value_);
+                id->cache_ = global;
+                id->cache_version_ = version_;
+            }
+            return *static_cast<Variable*>(const_cast<void*>(id->cache_));
+        }
+
+        /* the global read by 'id', nullptr if it was never declared nor assigned */
+        const Variable* Find(SyntaxTree* id) {
+            if (id->cache_version_ != version_) {
+                ++lookups_;
+                auto global = context_.find(id->value_);
+                if (global == context_.end())
+                    return nullptr;
+                id->cache_ = &global->second;
+                id->cache_version_ = version_;
+            }
+            return static_cast<const Variable*>(id->cache_);
+        }
+
+        /* the builtin of a call, nullptr if there is none */
+        Builtin Callee(SyntaxTree* call) {
+            if (call->cache_version_ != version_) {
+                ++lookups_;
+                auto builtin = builtins_.find(call->left_->value_);
+                call->cache_ = builtin == builtins_.end() ? nullptr : &builtin->second;
+                call->cache_version_ = version_;
+            }
+            return call->cache_ ? *static_cast<const Builtin*>(call->cache_) : nullptr;
+        }
+
+        /* the names changed in a way the block did not see, like a direct write to the tables */
+        void Invalidate() {
+            version_ = NextVersion();
+        }
+
+        /* hash lookups done by the caches */
+        long Lookups() const {
+            return lookups_;
+        }
+
+        /*
+         * The variables of the open scopes are on one stack, each scope starting
+         * where the stack was when it was entered, so a scope is left by cutting the stack.
+         */
+        void Enter() {
+            scopes_.push_back(locals_.size());
+        }
+
+        void Leave() {
+            locals_.resize(scopes_.back());
+            scopes_.pop_back();
         }
 
-        Context context_;
+        /* open scopes, 0 at the top level */
+        size_t Depth() const {
+            return scopes_.size();
+        }
+
+        /* the slots of a scope are declared in order, a redeclaration reuses its slot */
+        void Declare(int slot, const Variable& value) {
+            size_t index = scopes_.back() + slot;
+            if (index == locals_.size())
+                locals_.push_back(value);
+            else
+                locals_[index] = value;
+        }
+
+        /* a variable resolved to 'scope' scopes out from the innermost one */
+        Variable& Local(int scope, int slot) {
+            return locals_[scopes_[scopes_.size() - 1 - scope] + slot];
+        }
+
+        /* collect the heap if it is due, only between statements, where every array is in a variable */
+        void Safepoint(bool full = false) {
+            if (!full && !heap_.Due())
+                return;
+            vector<GC::Array**> roots;
+            for (auto& i: context_)
+                Root(i.second, roots);
+            for (auto& i: locals_)
+                Root(i, roots);
+            if (pinned_) {
+                for (auto& i: *pinned_)
+                    Root(i, roots);
+            }
+            heap_.Collect(roots, full);
+        }
+
+        /* values kept out of the variables, which a collection must see too */
+        void Pin(vector<Variable>* values) {
+            pinned_ = values;
+        }
+
+        Context context_; // the globals
+        GC::Heap heap_;
         FunctionTable fun_table_;
-        Block* up_;
-        Block* down_;
+        BuiltinTable builtins_;
+        vector<Variable> locals_;
+        vector<size_t> scopes_; // where each open scope starts in locals_
+
+    private:
+        /* versions are unique across blocks, so a node run in another block misses */
+        static long NextVersion() {
+            static std::atomic<long> version(0);
+            return ++version;
+        }
+
+        Variable& Slot(const string& id) {
+            ++lookups_;
+            auto global = context_.find(id);
+            if (global == context_.end()) {
+                global = context_.emplace(id, Variable()).first;
+                Invalidate();
+            }
+            return global->second;
+        }
+
+        void Root(Variable& variable, vector<GC::Array**>& roots) {
+            if (variable.type_id == GetId("array"))
+                roots.push_back(reinterpret_cast<GC::Array**>(&variable.v.p));
+        }
+
+        long stamp_;
+        std::unordered_map<string, long> written_; // variable -> stamp of its last write
+        long version_; // of the names of context_ and builtins_
+        long lookups_;
+        vector<Variable>* pinned_;
+};
+
+/*
+ * What an evaluation did, a line per statement run: the variable it wrote and the value,
+ * an element it wrote, or what a call gave. Nothing is formatted until asked, and
+ * the values are good until the next evaluation. An array is held rather than copied,
+ * so it shows the elements it has when formatted.
+ */
+class Evaluation {
+    public:
+        struct Line {
+            string id; // empty for a call
+            int index; // of the element written, -1 for a variable
+            bool declared;
+        };
+
+        size_t Size() const {
+            return lines_.size();
+        }
+
+        const Line& At(size_t i) const {
+            return lines_[i];
+        }
+
+        const Variable& Value(size_t i) const {
+            return values_[i];
+        }
+
+        void Add(const string& id, const Variable& value, int index = -1, bool declared = false) {
+            Line line = { id, index, declared };
+            lines_.push_back(line);
+            values_.push_back(value);
+        }
+
+        /* the capacity stays, so evaluating again allocates nothing */
+        void Clear() {
+            lines_.clear();
+            values_.clear();
+        }
+
+        /* the lines as Evaluate has always shown them, with the numbers in 'style' */
+        void Append(string& out, Format::Style style = Format::kFixed) const {
+            bool first = true;
+            for (size_t i = 0; i < lines_.size(); i++) {
+                size_t start = out.size();
+                if (!first)
+                    out += '\n';
+                size_t text = out.size();
+                AppendLine(out, i, style);
+                /* a call giving nothing shows nothing */
+                if (out.size() == text)
+                    out.resize(start);
+                else
+                    first = false;
+            }
+        }
+
+        string Text(Format::Style style = Format::kFixed) const {
+            string out;
+            Append(out, style);
+            return out;
+        }
+
+    private:
+        void AppendLine(string& out, size_t i, Format::Style style) const {
+            const Line& line = lines_[i];
+            const Variable& value = values_[i];
+            if (line.id.empty()) {
+                value.Append(out, style);
+                return;
+            }
+            out += line.id;
+            if (line.index >= 0) {
+                out += '[';
+                Format::AppendInt(out, line.index);
+                out += ']';
+            }
+            out += " = ";
+            /* a new variable shows its type */
+            if (line.declared && value.type_id == GetId("double"))
+                out += "0.0";
+            else if (line.declared && value.type_id == GetId("pointer"))
+                out += "nullptr";
+            else
+                value.Append(out, style);
+        }
+
+        friend class Evaluator;
+
+        vector<Line> lines_;
+        vector<Variable> values_; // pinned in the block, so arrays are moved with the others
 };
 
 
 class Evaluator {
     public:
-        Evaluator(): scanner_(), parser_(), global_context_() {
+        /*
+         * A reactive evaluator keeps every assignment as the formula of its variable,
+         * and writing a variable recomputes the formulas depending on it, like a spreadsheet.
+         */
+        Evaluator(bool reactive = false): scanner_(), parser_(true), global_context_(),
+            reused_(0), reactive_(reactive), result_() {
             InitFunctionTable();
+            global_context_.Pin(&result_.values_);
         }
 
+        Evaluator(const Evaluator&) = delete;
+        Evaluator& operator = (const Evaluator&) = delete;
+
         string Evaluate(const string& code) {
             return Evaluate(code.c_str());
         }
 
+        /* the evaluation as text */
         string Evaluate(const char* code) {
+            return Run(code).Text();
+        }
+
+        const Evaluation& Run(const string& code) {
+            return Run(code.c_str());
+        }
+
+        /* the evaluation as it is, without any text, good until the next one */
+        const Evaluation& Run(const char* code) {
+            CS_TRACE_SCOPE("evaluate");
+            result_.Clear();
             TokenList&& token_list = scanner_.Scan(code);
             shared_ptr<SyntaxTree> tree(parser_.Parse(token_list));
-            return BlockEvaluate(tree.get(), global_context_);
+            if (reactive_ && tree)
+                Update(tree);
+            else
+                BlockEvaluate(tree.get(), global_context_);
+            CS_TRACE_COUNT("results", result_.Size());
+            return result_;
+        }
+
+        /* persist the global variables, see snapshot.hpp */
+        bool Save(const string& file_path) {
+            return Snapshot::Save(global_context_.context_, file_path.c_str());
+        }
+
+        bool Restore(const string& file_path) {
+            if (!Snapshot::Restore(global_context_.context_, file_path.c_str(),
+                        &global_context_.heap_))
+                return false;
+            global_context_.Invalidate();
+            for (auto& i: global_context_.context_)
+                global_context_.Touch(i.first);
+            return true;
+        }
+
+        /* collections of the array heap, and their pauses */
+        const GC::Stats& Collector() const {
+            return global_context_.heap_.Statistics();
+        }
+
+        /* collect both generations now */
+        void Collect() {
+            global_context_.Safepoint(true);
+        }
+
+        /* how many times a shared expression is not computed again */
+        long Reused() const {
+            return reused_;
+        }
+
+        /* how many times a name is looked up in a table, not found in an inline cache */
+        long Lookups() const {
+            return global_context_.Lookups();
         }
 
     private:
 
         void InitFunctionTable() {
             Function::RegisterFunctions(global_context_.fun_table_);
+            Function::RegisterBuiltins(global_context_.builtins_);
+            global_context_.Invalidate();
+        }
+
+        // reactive evaluation
+
+        struct Formula {
+            shared_ptr<SyntaxTree> tree; // the assignment is its first statement
+            vector<string> reads;
+        };
+
+        /* every variable written is followed by the formulas recomputed after it */
+        void Update(const shared_ptr<SyntaxTree>& tree) {
+            SyntaxTree* statement = tree.get();
+            bool assignment = statement->type_ == GetId("=");
+            bool declaration = statement->type_ == 36 || statement->type_ == 37 ||
+                statement->type_ == 38 || statement->type_ == 39;
+            if (!assignment && !declaration)
+                return BlockEvaluate(statement, global_context_);
+
+            /* an element has no formula, but what reads elements is recomputed */
+            if (assignment && statement->left_->type_ == GetId("["))
+                return Propagate(statement, Dependents(kElements));
+
+            string id = statement->left_->value_;
+            vector<string> order = Dependents(id);
+            if (declaration)
+                Forget(id);
+            if (assignment) {
+                Formula formula = { tree, vector<string>() };
+                Reads(statement->right_, formula.reads);
+                std::sort(formula.reads.begin(), formula.reads.end());
+                formula.reads.erase(std::unique(formula.reads.begin(), formula.reads.end()),
+                        formula.reads.end());
+                /* reading a variable which depends on 'id' closes a cycle */
+                for (auto& read: formula.reads) {
+                    if (std::find(order.begin(), order.end(), read) != order.end()) {
+                        Report(nullptr, -1, "cyclic dependency: " + id + " reads " + read);
+                        return;
+                    }
+                }
+                Forget(id);
+                for (auto& read: formula.reads)
+                    readers_[read].insert(id);
+                formulas_[id] = formula;
+            }
+
+            Propagate(statement, order);
+        }
+
+        /* run the statement, then the formulas after the variable it writes */
+        void Propagate(SyntaxTree* statement, const vector<string>& order) {
+            BlockEvaluate(statement, global_context_);
+            for (size_t i = 1; i < order.size(); i++)
+                Assignment(formulas_[order[i]].tree.get(), global_context_);
+        }
+
+        /* 'id' and the variables depending on it, each after all it reads */
+        vector<string> Dependents(const string& id) {
+            vector<string> order;
+            std::set<string> visited;
+            Visit(id, visited, order);
+            std::reverse(order.begin(), order.end());
+            return order;
         }
 
-        string BlockEvaluate(SyntaxTree* tree, Block& context) {
-            if (!tree) return string();
+        void Visit(const string& id, std::set<string>& visited, vector<string>& order) {
+            visited.insert(id);
+            auto readers = readers_.find(id);
+            if (readers != readers_.end()) {
+                for (auto& reader: readers->second) {
+                    if (!visited.count(reader))
+                        Visit(reader, visited, order);
+                }
+            }
+            order.push_back(id);
+        }
+
+        /* the variable is an input again, e.g. after a declaration */
+        void Forget(const string& id) {
+            auto formula = formulas_.find(id);
+            if (formula == formulas_.end()) return;
+            for (auto& read: formula->second.reads)
+                readers_[read].erase(id);
+            formulas_.erase(formula);
+        }
+
+        void Reads(SyntaxTree* tree, vector<string>& reads) {
+            if (!tree) return;
+            if (tree->shared_) {
+                reads.insert(reads.end(), tree->inputs_.begin(), tree->inputs_.end());
+            } else if (tree->type_ == GetId("identifier_type")) {
+                reads.push_back(tree->value_);
+            } else if (tree->type_ == GetId("call_type")) {
+                /* the left is the function, the arguments are linked through next_ */
+                reads.push_back(kElements); // a builtin may read the elements of an array
+                for (SyntaxTree* arg = tree->right_; arg; arg = arg->next_)
+                    Reads(arg, reads);
+            } else {
+                if (tree->type_ == GetId("["))
+                    reads.push_back(kElements);
+                Reads(tree->left_, reads);
+                Reads(tree->right_, reads);
+            }
+        }
+
+        void BlockEvaluate(SyntaxTree* tree, Block& context) {
+            if (!tree) return;
+            context.Safepoint();
             
             /* distribute different kind of code */
             if (tree->type_ == 36 || tree->type_ == 37 ||
-                    tree->type_ == 38) {
+                    tree->type_ == 38 || tree->type_ == 39) {
                 /* variable statement */
                 return Statement(tree, context);
             } else if (tree->type_ == GetId("=")) {
@@ -100,115 +517,310 @@ class Evaluator {
             } else if (tree->type_ == GetId("for")) {
                 /* for block */
                 return ForBlock(tree, context);
+            } else if (tree->type_ == GetId("{")) {
+                /* nested scope */
+                return Scope(tree, context);
             } else {
                 /* error */
-                std::cerr << "syntax error: " << tree->value_ << std::endl;
-                exit(4);
+                Report(nullptr, -1, "syntax error: " + tree->value_);
             }
         }
 
-        string Statement(SyntaxTree* tree, Block& context) {
+        void Statement(SyntaxTree* tree, Block& context) {
             int type = tree->type_;
-            string id = tree->left_->value_;
-            string res;
+            Variable value;
 
             switch (type) {
                 /* int */
                 case 36: 
-                    context[id] = Variable(0);
-                    res = id + " = 0";
+                    value = Variable(0);
                     break;
                 /* double */
                 case 37:
-                    context[id] = Variable(0.0);
-                    res = id + " = 0.0";
+                    value = Variable(0.0);
                     break;
                 /* pointer */
                 case 38:
-                    context[id] = Variable(nullptr);
-                    res = id + " = nullptr";
+                    value = Variable(static_cast<void*>(nullptr));
+                    break;
+                /* string */
+                case 39:
+                    value = Variable(string(), GetId("string"));
                     break;
                 default:
                     assert(false);
             }
-            return res;
+            /* an array which failed is still declared, empty, so the next slots stay in place */
+            bool allocated = !tree->right_ || Allocate(tree, context, value);
+            if (tree->left_->scope_ < 0) {
+                context.Global(tree->left_) = value;
+                context.Touch(tree->left_->value_);
+            } else
+                context.Declare(tree->left_->slot_, value);
+            if (allocated)
+                result_.Add(tree->left_->value_, value, -1, !tree->right_);
         }
 
-        string Assignment(SyntaxTree* tree, Block& context) {
+        /* the array declared by 'int[n] a' or 'double[n] a' */
+        bool Allocate(SyntaxTree* tree, Block& context, Variable& value) {
+            if (tree->type_ != 36 && tree->type_ != 37) {
+                Report(nullptr, tree->offset_, "arrays hold numbers only: " + tree->value_);
+                return false;
+            }
+            Variable size = Expression(tree->right_, context);
+            if (size.type_id != GetId("int") || size.GetInt() < 0) {
+                Report(nullptr, tree->right_->offset_, "array size must be an int, not less than 0");
+                return false;
+            }
+            if (static_cast<size_t>(size.GetInt()) > GC::kMaxLength) {
+                Report(nullptr, tree->right_->offset_, "array too large: " + std::to_string(size.GetInt()));
+                return false;
+            }
+            int type = tree->type_ == 36 ? GetId("int") : GetId("double");
+            value = Variable(context.heap_.Allocate(type, size.GetInt()));
+            return true;
+        }
+
+        void Assignment(SyntaxTree* tree, Block& context) {
             assert(tree->type_ == 14);
-            string id = tree->left_->value_;
+            if (tree->left_->type_ == GetId("["))
+                return Store(tree, context);
+            const string& id = tree->left_->value_;
             SyntaxTree* expr = tree->right_;
             Variable value = Expression(expr, context);
-            context[id] = value;
-            return id + " = " + value.to_string();
+            /* the error is reported already, the variable keeps its value */
+            if (value.Empty())
+                return;
+            if (tree->left_->scope_ < 0) {
+                context.Global(tree->left_) = value;
+                context.Touch(id);
+            } else
+                context.Local(tree->left_->scope_, tree->left_->slot_) = value;
+            result_.Add(id, value);
         }
 
+        /*
+         * The parser shares equal subtrees, so an operator node is computed once
+         * and reused until one of the variables it reads is written.
+         */
         Variable Expression(SyntaxTree* tree, Block& context) {
+            if (!tree->shared_ || !tree->right_)
+                return Compute(tree, context);
+            if (tree->memo_stamp_ >= 0 &&
+                    context.Unchanged(tree->inputs_, tree->memo_stamp_)) {
+                ++reused_;
+                return tree->memo_;
+            }
+            tree->memo_ = Compute(tree, context);
+            tree->memo_stamp_ = context.Stamp();
+            return tree->memo_;
+        }
+
+        Variable Compute(SyntaxTree* tree, Block& context) {
             if (tree->type_ == GetId("int") ||
                     tree->type_ == GetId("double")) {
             // current node is a number
                 return Variable(tree->value_, tree->type_);
+            } else if (tree->type_ == GetId("string_type")) {
+            // a string
+                return Variable(tree->value_, GetId("string"));
+            } else if (tree->type_ == GetId("identifier_type")) {
+            // or a variable
+                if (tree->scope_ >= 0)
+                    return context.Local(tree->scope_, tree->slot_);
+                /* only a declaration or an assignment makes a global */
+                const Variable* global = context.Find(tree);
+                if (!global) {
+                    Report(nullptr, tree->offset_, "undefined variable: " + tree->value_);
+                    return Variable();
+                }
+                return *global;
+            } else if (tree->type_ == GetId("[")) {
+            // an element
+                GC::Array* array;
+                GC::Element* element = Element(tree, context, array);
+                if (!element)
+                    return Variable();
+                return array->type_id == GetId("int") ? Variable(element->i) : Variable(element->d);
+            } else if (tree->type_ == GetId("call_type")) {
+            // a builtin
+                return Invoke(tree, context);
+            }
+            // or it's a expression, unary minus has no left operand
+            Variable lhs = tree->left_ ? Expression(tree->left_, context) : Variable(0);
+            Variable rhs = Expression(tree->right_, context);
+            switch (tree->type_) {
+                case 10:
+                    return lhs + rhs;
+                case 11:
+                    return lhs - rhs;
+                case 12:
+                    return lhs * rhs;
+                case 13:
+                    return lhs / rhs;
+                case 15:
+                    return lhs == rhs;
+                case 16:
+                    return lhs != rhs;
+                default:
+                    assert(false);
+                    return Variable();
+            }
+        }
+
+        /* 'a[i] = x', the number is converted to the type of the array */
+        void Store(SyntaxTree* tree, Block& context) {
+            GC::Array* array;
+            GC::Element* element = Element(tree->left_, context, array);
+            if (!element)
+                return;
+            Variable value = Expression(tree->right_, context);
+            if (value.Empty())
+                return;
+            if (value.type_id != GetId("int") && value.type_id != GetId("double")) {
+                Report(nullptr, tree->right_->offset_, "arrays hold numbers only");
+                return;
+            }
+            if (array->type_id == GetId("int"))
+                element->i = static_cast<int>(value.GetAny());
+            else
+                element->d = value.GetAny();
+            context.Touch(kElements);
+            Variable stored = array->type_id == GetId("int") ? Variable(element->i) :
+                Variable(element->d);
+            result_.Add(tree->left_->left_->value_, stored, element - array->data);
+        }
+
+        /* the element 'tree' stands for, or nullptr after reporting why not */
+        GC::Element* Element(SyntaxTree* tree, Block& context, GC::Array*& array) {
+            Variable base = Expression(tree->left_, context);
+            if (base.type_id != GetId("array")) {
+                Report(nullptr, tree->offset_, "not an array: " + tree->left_->value_);
+                return nullptr;
+            }
+            array = static_cast<GC::Array*>(base.GetPointer());
+            Variable index = Expression(tree->right_, context);
+            if (index.type_id != GetId("int") || index.GetInt() < 0 ||
+                    static_cast<uint32_t>(index.GetInt()) >= array->length) {
+                Report(nullptr, tree->right_->offset_, "index " + index.to_string() +
+                        " out of bounds for " + std::to_string(array->length) + " elements");
+                return nullptr;
+            }
+            return &array->data[index.GetInt()];
+        }
+
+        /* every statement written in the block is shown */
+        void Scope(SyntaxTree* tree, Block& context) {
+            if (context.Depth() == 0) {
+                Names names;
+                Resolve(tree, names);
+            }
+            context.Enter();
+            for (SyntaxTree* statement = tree->left_; statement; statement = statement->next_)
+                BlockEvaluate(statement, context);
+            context.Leave();
+        }
+
+        typedef vector<std::unordered_map<string, int>> Names; // per open scope, name -> slot
+
+        /*
+         * Before a block runs, bind every variable in it to its scope and slot,
+         * a name declared in none of the enclosing blocks is a global.
+         */
+        void Resolve(SyntaxTree* tree, Names& names) {
+            if (!tree) return;
+            if (tree->type_ == GetId("{")) {
+                names.emplace_back();
+                for (SyntaxTree* statement = tree->left_; statement; statement = statement->next_)
+                    Resolve(statement, names);
+                names.pop_back();
+            } else if (tree->type_ == 36 || tree->type_ == 37 || tree->type_ == 38 ||
+                    tree->type_ == 39) {
+                Resolve(tree->right_, names);
+                auto& scope = names.back();
+                int slot = scope.size();
+                scope.emplace(tree->left_->value_, slot);
+                Bind(tree->left_, names);
+            } else if (tree->type_ == GetId("identifier_type")) {
+                Bind(tree, names);
+            } else if (tree->type_ == GetId("call_type")) {
+                for (SyntaxTree* arg = tree->right_; arg; arg = arg->next_)
+                    Resolve(arg, names);
             } else {
-            // or it's a expression
-                Variable res(tree->left_->value_, tree->left_->type_);
-                Variable lhs = Expression(tree->left_, context);
-                Variable rhs = Expression(tree->right_, context);
-                switch (tree->type_) {
-                    case 10:
-                        res = lhs + rhs;
-                        break;
-                    case 11:
-                        res = lhs - rhs;
-                        break;
-                    case 12:
-                        res = lhs * rhs;
-                        break;
-                    case 13:
-                        res = lhs / rhs;
-                        break;
-                    //case 14:
-                    //    res.v = rhs;
-                    //    break;
-                    //case 15:
-                    //    res.v = (lhs == rhs);
-                    //    break;
-                    //case 16:
-                    //    res.v = !(lhs == rhs);
-                    //    break;
-                    default:
-                        assert(false);
+                Resolve(tree->left_, names);
+                Resolve(tree->right_, names);
+            }
+        }
+
+        void Bind(SyntaxTree* id, const Names& names) {
+            id->scope_ = -1;
+            for (size_t i = names.size(); i-- > 0;) {
+                auto slot = names[i].find(id->value_);
+                if (slot != names[i].end()) {
+                    id->scope_ = names.size() - 1 - i;
+                    id->slot_ = slot->second;
+                    return;
                 }
-                return res;
             }
         }
 
-        string Call(SyntaxTree* tree, Block& context) {
+        void Call(SyntaxTree* tree, Block& context) {
             assert(tree->type_ == GetId("call_type"));
-            string fun = tree->left_->value_;
+            const string& fun = tree->left_->value_;
+            if (context.Callee(tree)) {
+                result_.Add(string(), Invoke(tree, context));
+                return;
+            }
             FunPtr f = context.Load(fun);
+            if (!f) {
+                Report(nullptr, tree->offset_, "undefined function: " + fun);
+                return;
+            }
             f();
-            return "";
         }
 
-        string IfBlock(SyntaxTree* tree, Block& context) {
+        Variable Invoke(SyntaxTree* tree, Block& context) {
+            Builtin builtin = context.Callee(tree);
+            if (!builtin) {
+                Report(nullptr, tree->offset_, "undefined function: " + tree->left_->value_);
+                return Variable();
+            }
+            Arguments args;
+            bool arrays = false;
+            for (SyntaxTree* arg = tree->right_; arg; arg = arg->next_) {
+                args.push_back(Expression(arg, context));
+                if (args.back().Empty())
+                    return Variable();
+                arrays = arrays || args.back().type_id == GetId("array");
+            }
+            Variable res = builtin(args, context.heap_);
+            /* it may have written the elements, as axpy does */
+            if (arrays)
+                context.Touch(kElements);
+            return res;
+        }
+
+        void IfBlock(SyntaxTree* tree, Block& context) {
             assert(tree->type_ == 32);
-            return "shit";
         }
 
-        string WhileBlock(SyntaxTree* tree, Block& context) {
+        void WhileBlock(SyntaxTree* tree, Block& context) {
             assert(tree->type_ == 34);
-            return "shit";
         }
 
-        string ForBlock(SyntaxTree* tree, Block& context) {
+        void ForBlock(SyntaxTree* tree, Block& context) {
             assert(tree->type_ == 45);
-            return "shit";
         }
 
         /* members */
         Scanner scanner_;
         Parser parser_;
         Block global_context_;
+        long reused_;
+        bool reactive_;
+        std::unordered_map<string, Formula> formulas_; // variable -> its last assignment
+        std::unordered_map<string, std::set<string>> readers_; // variable -> formulas reading it
+        Evaluation result_; // of the last Run
 };
 }
 #endif
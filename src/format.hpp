@@ -0,0 +1,83 @@
+/**
+ * Numbers to text, appended to a buffer the caller keeps, so nothing is allocated
+ * once the buffer is large enough.
+ * A double is written either as printf's %f does, which Evaluate has always shown,
+ * or as the shortest text which reads back to the same double, which the REPL shows.
+ */
+
+#ifndef FORMAT_HPP
+#define FORMAT_HPP
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace CS {
+    namespace Format {
+        using std::string;
+
+        enum Style {
+            kFixed, // 6 decimals, as std::to_string
+            kShortest
+        };
+
+        inline void AppendInt(string& out, long long value) {
+            char digits[24];
+            char* p = digits + sizeof(digits);
+            /* negative, so the minimum has a magnitude too */
+            long long n = value < 0 ? value : -value;
+            do {
+                *--p = static_cast<char>('0' - n % 10);
+                n /= 10;
+            } while (n);
+            if (value < 0)
+                *--p = '-';
+            out.append(p, digits + sizeof(digits) - p);
+        }
+
+        inline void AppendFixed(string& out, double value) {
+            char text[512];
+            int size = snprintf(text, sizeof(text), "%f", value);
+            out.append(text, size);
+        }
+
+        /*
+         * 15 significant digits are exact for most values met in practice,
+         * up to 17 are needed to tell every double apart.
+         */
+        inline void AppendShortest(string& out, double value) {
+            if (std::isnan(value)) {
+                out += "nan";
+                return;
+            }
+            if (std::isinf(value)) {
+                out += value < 0 ? "-inf" : "inf";
+                return;
+            }
+            /* an integral value keeps a decimal, so it still reads as a double */
+            if (value == std::floor(value) && std::fabs(value) < 1e15) {
+                if (std::signbit(value))
+                    out += '-';
+                AppendInt(out, static_cast<long long>(std::fabs(value)));
+                out += ".0";
+                return;
+            }
+            char text[32];
+            int size = 0;
+            for (int precision = 15; precision <= 17; precision++) {
+                size = snprintf(text, sizeof(text), "%.*g", precision, value);
+                if (strtod(text, nullptr) == value)
+                    break;
+            }
+            out.append(text, size);
+        }
+
+        inline void AppendDouble(string& out, double value, Style style) {
+            if (style == kFixed)
+                AppendFixed(out, value);
+            else
+                AppendShortest(out, value);
+        }
+    }
+}
+#endif
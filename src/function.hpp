@@ -2,13 +2,22 @@
 #define FUNCTION_HPP
 #include <cstdio>
 #include <unordered_map>
+#include <vector>
 
-
+#include "variable.hpp"
+#include "diagnostic.hpp"
+#include "simd.hpp"
+#include "pool.hpp"
 
 namespace CS {
     typedef void(*FunPtr)(void);
     typedef std::unordered_map<std::string, FunPtr> FunctionTable;
 
+    /* builtins of the evaluator, which take values and give one back, new arrays go on 'heap' */
+    typedef std::vector<Variable, Pool::Allocator<Variable>> Arguments;
+    typedef Variable(*Builtin)(Arguments& args, GC::Heap& heap);
+    typedef std::unordered_map<std::string, Builtin> BuiltinTable;
+
     namespace Function {
         void println() {
             printf("3\n");
@@ -17,6 +26,152 @@ namespace CS {
         void RegisterFunctions(FunctionTable& fun_table) {
             fun_table["println"] = println;
         }
+
+        Variable Println(Arguments& args, GC::Heap&) {
+            string line;
+            for (size_t i = 0; i < args.size(); i++)
+                line += (i ? " " : "") + args[i].to_string();
+            printf("%s\n", line.c_str());
+            return Variable();
+        }
+
+        Variable Len(Arguments& args, GC::Heap&) {
+            if (args.size() == 1 && args[0].type_id == GetId("array"))
+                return Variable(static_cast<int>(static_cast<GC::Array*>(args[0].v.p)->length));
+            if (args.size() != 1 || args[0].type_id != GetId("string")) {
+                Report(nullptr, -1, "len takes a string or an array");
+                return Variable();
+            }
+            return Variable(static_cast<int>(Strings::Size(args[0].v.s)));
+        }
+
+        Variable Concat(Arguments& args, GC::Heap&) {
+            Variable res = Variable::String(Strings::Make(""));
+            for (auto& arg: args) {
+                if (arg.type_id != GetId("string")) {
+                    Report(nullptr, -1, "concat takes strings");
+                    return Variable();
+                }
+                res = res + arg;
+            }
+            return res;
+        }
+
+        // array builtins, on the kernels of simd.hpp
+
+        /* the arrays in 'args', or nullptr after reporting, they have the same type and length */
+        GC::Array* Arrays(Arguments& args, size_t count, const char* name,
+                GC::Array** arrays) {
+            for (size_t i = 0; i < count; i++) {
+                if (args.size() != count || args[i].type_id != GetId("array")) {
+                    Report(nullptr, -1, string(name) + " takes " + std::to_string(count) +
+                            (count == 1 ? " array" : " arrays"));
+                    return nullptr;
+                }
+                arrays[i] = static_cast<GC::Array*>(args[i].v.p);
+                if (arrays[i]->type_id != arrays[0]->type_id || arrays[i]->length != arrays[0]->length) {
+                    Report(nullptr, -1, string(name) + " takes arrays of one type and length");
+                    return nullptr;
+                }
+            }
+            return arrays[0];
+        }
+
+        Variable Element(const GC::Array* array, GC::Element element) {
+            return array->type_id == GetId("double") ? Variable(element.d) : Variable(element.i);
+        }
+
+        template <Simd::Op op>
+        Variable Reduce(Arguments& args, const char* name) {
+            GC::Array* array;
+            if (!Arrays(args, 1, name, &array))
+                return Variable();
+            bool is_double = array->type_id == GetId("double");
+            if (array->length == 0) {
+                /* the sum of nothing is 0, its min and max are undefined */
+                if (op != Simd::kAdd) {
+                    Report(nullptr, -1, string(name) + " of an empty array");
+                    return Variable();
+                }
+                return is_double ? Variable(0.0) : Variable(0);
+            }
+            return Element(array, Simd::Reduce<op>(is_double, array->data, array->length));
+        }
+
+        Variable Sum(Arguments& args, GC::Heap&) {
+            return Reduce<Simd::kAdd>(args, "sum");
+        }
+
+        Variable Min(Arguments& args, GC::Heap&) {
+            return Reduce<Simd::kMin>(args, "min");
+        }
+
+        Variable Max(Arguments& args, GC::Heap&) {
+            return Reduce<Simd::kMax>(args, "max");
+        }
+
+        Variable Dot(Arguments& args, GC::Heap&) {
+            GC::Array* arrays[2];
+            if (!Arrays(args, 2, "dot", arrays))
+                return Variable();
+            bool is_double = arrays[0]->type_id == GetId("double");
+            return Element(arrays[0], Simd::Dot(is_double, arrays[0]->data, arrays[1]->data,
+                        arrays[0]->length));
+        }
+
+        /* a new array */
+        template <Simd::Op op>
+        Variable Map(Arguments& args, GC::Heap& heap, const char* name) {
+            GC::Array* arrays[2];
+            if (!Arrays(args, 2, name, arrays))
+                return Variable();
+            GC::Array* res = heap.Allocate(arrays[0]->type_id, arrays[0]->length);
+            Simd::Map<op>(arrays[0]->type_id == GetId("double"), arrays[0]->data, arrays[1]->data,
+                    res->data, res->length);
+            return Variable(res);
+        }
+
+        Variable Add(Arguments& args, GC::Heap& heap) {
+            return Map<Simd::kAdd>(args, heap, "add");
+        }
+
+        Variable Mul(Arguments& args, GC::Heap& heap) {
+            return Map<Simd::kMul>(args, heap, "mul");
+        }
+
+        /* axpy(alpha, x, y) adds alpha * x to y in place, and gives y */
+        Variable Axpy(Arguments& args, GC::Heap&) {
+            if (args.size() != 3 || (args[0].type_id != GetId("int") &&
+                        args[0].type_id != GetId("double"))) {
+                Report(nullptr, -1, "axpy takes a number and 2 arrays");
+                return Variable();
+            }
+            Arguments vectors(args.begin() + 1, args.end());
+            GC::Array* arrays[2];
+            if (!Arrays(vectors, 2, "axpy", arrays))
+                return Variable();
+            bool is_double = arrays[0]->type_id == GetId("double");
+            GC::Element alpha;
+            if (is_double)
+                alpha.d = args[0].GetAny();
+            else
+                alpha.i = static_cast<int>(args[0].GetAny());
+            Simd::Axpy(is_double, alpha, arrays[0]->data, arrays[1]->data, arrays[1]->length);
+            return args[2];
+        }
+
+        void RegisterBuiltins(BuiltinTable& builtins) {
+            builtins["println"] = Println;
+            builtins["len"] = Len;
+            builtins["concat"] = Concat;
+            builtins["sum"] = Sum;
+            builtins["min"] = Min;
+            builtins["max"] = Max;
+            builtins["dot"] = Dot;
+            builtins["add"] = Add;
+            builtins["mul"] = Mul;
+            builtins["axpy"] = Axpy;
+        }
     }
 }
 #endif
@@ -0,0 +1,227 @@
+/**
+ * A generational heap for arrays.
+ * New arrays are bump-allocated in a nursery, and the survivors are copied out
+ * into the old generation, which is itself collected by copying once it outgrows its limit.
+ * Arrays hold numbers only, so the roots are the only pointers into the heap,
+ * and objects move only in Collect, which the evaluator calls between statements.
+ */
+
+#ifndef GC_HPP
+#define GC_HPP
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+namespace CS {
+    namespace GC {
+        union Element {
+            int i;
+            double d;
+        };
+
+        struct Array {
+            uint32_t length;
+            int32_t type_id; // of the elements, int or double
+            Array* forward; // the copy made by the running collection
+            Element data[1]; // 'length' elements in fact
+
+            static size_t Bytes(size_t length) {
+                size_t bytes = offsetof(Array, data) + length * sizeof(Element);
+                return (bytes + 7) & ~static_cast<size_t>(7);
+            }
+
+            size_t Bytes() const {
+                return Bytes(length);
+            }
+        };
+
+        struct Stats {
+            long minor; // collections of the nursery only
+            long major; // collections of both generations
+            long long pause_ns; // in all collections
+            long long max_pause_ns;
+            size_t allocated; // bytes, since the start
+            size_t promoted; // bytes copied from the nursery to the old generation
+            size_t freed; // bytes
+            size_t live; // bytes in the old generation after the last collection
+        };
+
+        const size_t kNursery = 256 << 10;
+        const size_t kChunk = 1 << 20;
+        const size_t kOldLimit = 4 << 20;
+        const size_t kMaxLength = 1 << 24; // elements in one array, 128 MB
+
+        class Heap {
+            public:
+                Heap(size_t nursery = kNursery): nursery_size_(nursery), nursery_top_(0),
+                    old_(), old_used_(0), old_limit_(kOldLimit), pending_(false), stats_() {
+                    nursery_ = static_cast<char*>(malloc(nursery_size_));
+                    if (nursery_ == nullptr)
+                        throw std::bad_alloc();
+                }
+
+                ~Heap() {
+                    Free(old_);
+                    free(nursery_);
+                }
+
+                Heap(const Heap&) = delete;
+                Heap& operator = (const Heap&) = delete;
+
+                /* a zeroed array, which stays where it is until the next Collect */
+                Array* Allocate(int type_id, size_t length) {
+                    assert(length <= kMaxLength);
+                    size_t bytes = Array::Bytes(length);
+                    char* memory;
+                    /* a large array, or one which does not fit any more, goes to the old generation */
+                    if (bytes > nursery_size_ / 4) {
+                        memory = Allocate(old_, bytes);
+                        old_used_ += bytes;
+                    } else if (nursery_top_ + bytes > nursery_size_) {
+                        memory = Allocate(old_, bytes);
+                        old_used_ += bytes;
+                        pending_ = true;
+                    } else {
+                        memory = nursery_ + nursery_top_;
+                        nursery_top_ += bytes;
+                    }
+                    memset(memory, 0, bytes);
+                    Array* array = reinterpret_cast<Array*>(memory);
+                    array->length = length;
+                    array->type_id = type_id;
+                    stats_.allocated += bytes;
+                    return array;
+                }
+
+                /* a collection should run at the next safepoint */
+                bool Due() const {
+                    return pending_ || nursery_top_ > nursery_size_ / 2 || old_used_ > old_limit_;
+                }
+
+                /*
+                 * 'roots' point to every reference into the heap, and are updated to the copies.
+                 * The old generation is collected too when it is over its limit, or when 'full'.
+                 */
+                void Collect(const std::vector<Array**>& roots, bool full = false) {
+                    auto start = std::chrono::steady_clock::now();
+                    if (full || old_used_ > old_limit_)
+                        Major(roots);
+                    else
+                        Minor(roots);
+                    nursery_top_ = 0;
+                    pending_ = false;
+                    stats_.live = old_used_;
+                    long long pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start).count();
+                    stats_.pause_ns += pause;
+                    if (pause > stats_.max_pause_ns)
+                        stats_.max_pause_ns = pause;
+                }
+
+                const Stats& Statistics() const {
+                    return stats_;
+                }
+
+                bool InNursery(const Array* array) const {
+                    const char* address = reinterpret_cast<const char*>(array);
+                    return address >= nursery_ && address < nursery_ + nursery_size_;
+                }
+
+            private:
+                struct Chunk {
+                    char* base;
+                    size_t size;
+                    size_t top;
+                };
+                typedef std::vector<Chunk> Space;
+
+                /* the survivors of the nursery move to the old generation */
+                void Minor(const std::vector<Array**>& roots) {
+                    size_t promoted = 0;
+                    for (Array** root: roots) {
+                        if (*root == nullptr || !InNursery(*root))
+                            continue;
+                        if ((*root)->forward == nullptr) {
+                            size_t bytes = (*root)->Bytes();
+                            (*root)->forward = Copy(*root, old_, bytes);
+                            promoted += bytes;
+                        }
+                        *root = (*root)->forward;
+                    }
+                    old_used_ += promoted;
+                    stats_.promoted += promoted;
+                    stats_.freed += nursery_top_ - promoted;
+                    ++stats_.minor;
+                }
+
+                /* everything alive is copied to a new old generation */
+                void Major(const std::vector<Array**>& roots) {
+                    Space space;
+                    size_t used = 0;
+                    size_t promoted = 0;
+                    for (Array** root: roots) {
+                        if (*root == nullptr)
+                            continue;
+                        if ((*root)->forward == nullptr) {
+                            size_t bytes = (*root)->Bytes();
+                            if (InNursery(*root))
+                                promoted += bytes;
+                            (*root)->forward = Copy(*root, space, bytes);
+                            used += bytes;
+                        }
+                        *root = (*root)->forward;
+                    }
+                    Free(old_);
+                    old_.swap(space);
+                    stats_.promoted += promoted;
+                    stats_.freed += old_used_ + nursery_top_ - used;
+                    old_used_ = used;
+                    /* the next major collection when the old generation doubles */
+                    old_limit_ = used * 2 > kOldLimit ? used * 2 : kOldLimit;
+                    ++stats_.major;
+                }
+
+                Array* Copy(const Array* array, Space& space, size_t bytes) {
+                    Array* copy = reinterpret_cast<Array*>(Allocate(space, bytes));
+                    memcpy(copy, array, bytes);
+                    copy->forward = nullptr;
+                    return copy;
+                }
+
+                /* bump allocation in the last chunk of 'space' */
+                char* Allocate(Space& space, size_t bytes) {
+                    if (space.empty() || space.back().top + bytes > space.back().size) {
+                        size_t size = bytes > kChunk ? bytes : kChunk;
+                        Chunk chunk = { static_cast<char*>(malloc(size)), size, 0 };
+                        if (chunk.base == nullptr)
+                            throw std::bad_alloc();
+                        space.push_back(chunk);
+                    }
+                    char* memory = space.back().base + space.back().top;
+                    space.back().top += bytes;
+                    return memory;
+                }
+
+                void Free(Space& space) {
+                    for (auto& chunk: space)
+                        free(chunk.base);
+                    space.clear();
+                }
+
+                char* nursery_;
+                size_t nursery_size_;
+                size_t nursery_top_;
+                Space old_;
+                size_t old_used_; // bytes allocated in the old generation
+                size_t old_limit_;
+                bool pending_; // the nursery overflowed
+                Stats stats_;
+        };
+    }
+}
+#endif
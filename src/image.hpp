@@ -0,0 +1,87 @@
+/**
+ * The code of a program as many vms share it: instructions and symbols, verified once
+ * and never changed after, so any number of vms on any threads run one copy.
+ * A store publishes the current image of a program. Swapping in a new one does not touch
+ * the vms running the old, each holds a reference to what it loaded until it loads again.
+ */
+
+#ifndef IMAGE_HPP
+#define IMAGE_HPP
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "opcode.hpp"
+#include "verifier.hpp"
+#include "function.hpp"
+
+namespace CS {
+    namespace VM {
+        using OpCode::InstructionTable;
+        using OpCode::SymbolTable;
+
+        struct Image;
+        typedef std::shared_ptr<const Image> ImagePtr;
+
+        struct Image {
+            InstructionTable instructions; // as verified
+            SymbolTable symbols;
+            int max_depth; // of the stack, from an empty one
+            int exit_depth; // the stack left at the end
+            InstructionTable fused; // as the vms run it, see OpCode::Fuse
+            std::vector<int> origin; // of each fused instruction
+
+            /* nullptr if the code does not pass, the builtins are those of the vms to run it */
+            static ImagePtr Make(InstructionTable ins_tbl, SymbolTable sym_tbl,
+                    const FunctionTable& builtins) {
+                Verifier::StackInfo info = Verifier::Verify(ins_tbl, sym_tbl, builtins);
+                if (!info.ok) {
+                    std::cerr << "verify error: " << info.error << std::endl;
+                    return nullptr;
+                }
+                std::shared_ptr<Image> image(new Image());
+                OpCode::Fuse(ins_tbl, 0, image->fused, image->origin);
+                image->instructions = std::move(ins_tbl);
+                image->symbols = std::move(sym_tbl);
+                image->max_depth = info.max_depth;
+                image->exit_depth = info.exit_depth;
+                return image;
+            }
+
+            /* for vms with the default builtins */
+            static ImagePtr Make(InstructionTable ins_tbl, SymbolTable sym_tbl) {
+                FunctionTable builtins;
+                Function::RegisterFunctions(builtins);
+                return Make(std::move(ins_tbl), std::move(sym_tbl), builtins);
+            }
+        };
+
+        /*
+         * The image of a program now, read and replaced from any thread. The pointer is
+         * swapped atomically, and a reader takes its own reference, so the image it got
+         * stays alive after a swap. A vm reads it once per load, never while running.
+         */
+        class ImageStore {
+            public:
+                ImageStore() {}
+
+                explicit ImageStore(ImagePtr image): image_(std::move(image)) {}
+
+                ImageStore(const ImageStore&) = delete;
+                ImageStore& operator = (const ImageStore&) = delete;
+
+                ImagePtr Get() const {
+                    return std::atomic_load(&image_);
+                }
+
+                /* the old image goes when the last vm running it lets it go */
+                void Publish(ImagePtr image) {
+                    std::atomic_store(&image_, std::move(image));
+                }
+
+            private:
+                ImagePtr image_;
+        };
+    }
+}
+#endif
@@ -15,6 +15,7 @@ namespace CS {
         typedef unordered_map<string, int> OpCodeTable;
         typedef unordered_map<string, int> SymbolTable; // store identifer and index
         typedef vector<long long> InstructionTable;
+        typedef vector<std::pair<int, int> > SourceTable; // first pc of a statement and its source offset
 
 
         int GetOpCode(const string& op) {
@@ -40,7 +41,12 @@ namespace CS {
                 /* jump */
                 { "call",30 },
                 { "jmp", 31 },
-                { "ret", 32 }
+                { "ret", 32 },
+
+                /* superinstructions, made by the vm only, see Fuse */
+                { "store", 40 },
+                { "addi", 41 },
+                { "subi", 42 }
             };
             return opcodes[op];
         }
@@ -54,10 +60,45 @@ namespace CS {
             return MakeOpCode(GetOpCode(op), address);
         }
 
+        /* a negative address is sign extended over the opcode by MakeOpCode, so undo that first */
         static std::pair<int, int> SplitOpCode(long long instruction) {
+            int address = static_cast<int>(instruction);
             return std::make_pair(
-                    static_cast<int>(instruction >> 32),
-                    static_cast<int>(instruction));
+                    static_cast<int>((instruction ^ static_cast<long long>(address)) >> 32),
+                    address);
+        }
+
+        /*
+         * Pairs of instructions which come together all the time are made one, so they
+         * cost one dispatch: mov+pop ending every assignment, push+add and push+sub of
+         * a constant. 'origin' gets where each one started in 'ins_tbl', counted from 'base',
+         * for the faults. A table with jumps is kept as it is, its offsets count instructions.
+         * Only verified code is fused, and the verifier does not take what it makes.
+         */
+        static void Fuse(const InstructionTable& ins_tbl, int base, InstructionTable& out,
+                vector<int>& origin) {
+            bool jumps = false;
+            for (long long ins: ins_tbl)
+                jumps = jumps || SplitOpCode(ins).first == 31;
+            static const int store = GetOpCode("store"), addi = GetOpCode("addi"),
+                subi = GetOpCode("subi");
+            for (size_t pc = 0; pc < ins_tbl.size(); pc++) {
+                origin.push_back(base + pc);
+                std::pair<int, int> op_val = SplitOpCode(ins_tbl[pc]);
+                int next = !jumps && pc + 1 < ins_tbl.size() ? SplitOpCode(ins_tbl[pc + 1]).first : 0;
+                if (op_val.first == 3 && next == 2) {
+                    out.push_back(MakeOpCode(store, op_val.second));
+                    ++pc;
+                } else if (op_val.first == 1 && next == 20) {
+                    out.push_back(MakeOpCode(addi, op_val.second));
+                    ++pc;
+                } else if (op_val.first == 1 && next == 21) {
+                    out.push_back(MakeOpCode(subi, op_val.second));
+                    ++pc;
+                } else {
+                    out.push_back(ins_tbl[pc]);
+                }
+            }
         }
 
         class StackModel {
@@ -84,28 +125,57 @@ namespace CS {
                     return Action(op.c_str(), address);
                 }
 
+                /* stack_top_ counts slots of the vm's operand stack */
                 int Action(const char* op, int address = 0) {
                     instructions_->push_back(MakeOpCode(op, address));
-                    if (strcmp(op, "alloc")) {
-                        stack_top_ += address;
-                    } else if (strcmp(op, "push")) {
-                        stack_top_  += 4;
-                    } else if (strcmp(op, "pop")) {
-                        stack_top_ -= 4;
-                    } else if (strcmp(op, "load")) {
-                        stack_top_ += 4;
+                    if (strcmp(op, "alloc") == 0) {
+                        stack_top_ += address / sizeof(int);
+                    } else if (strcmp(op, "push") == 0 ||
+                            strcmp(op, "load") == 0) {
+                        stack_top_ += 1;
+                    } else if (strcmp(op, "pop") == 0 ||
+                            strcmp(op, "add") == 0 ||
+                            strcmp(op, "sub") == 0 ||
+                            strcmp(op, "mul") == 0 ||
+                            strcmp(op, "div") == 0) {
+                        stack_top_ -= 1;
                     }
                     return stack_top_;
                 }
 
+                int Depth() const {
+                    return stack_top_;
+                }
+
+                size_t Size() const {
+                    return instructions_->size();
+                }
+
+                int Symbols() const {
+                    return symbol_table_->size();
+                }
+
+                /* drop the instructions after 'size' and the symbols after 'symbols' */
+                void Truncate(size_t size, int depth, int symbols) {
+                    instructions_->resize(size);
+                    stack_top_ = depth;
+                    for (auto i = symbol_table_->begin(); i != symbol_table_->end(); ) {
+                        if (i->second > symbols)
+                            i = symbol_table_->erase(i);
+                        else
+                            ++i;
+                    }
+                }
+
                 /* function call*/
                 int Action(const string& op, const string& id) {
                     return Action(op.data(), id.data());
                 }
 
                 int Action(const char* op, const char* id) {
+                    /* a function called twice keeps its first index */
                     int index = symbol_table_->size() + 1;
-                    symbol_table_->emplace(id, index);
+                    index = symbol_table_->emplace(id, index).first->second;
                     //instructions_->push_back(MakeOpCode("reserve", 0));
                     instructions_->push_back(MakeOpCode(op, index));
                     return 0;
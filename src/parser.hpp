@@ -1,10 +1,13 @@
 #ifndef PARSER_HPP
 #define PARSER_HPP
-#include <stack>
 #include <memory>
+#include <algorithm>
+#include <unordered_map>
 
 #include "scanner.hpp"
 #include "util.hpp"
+#include "variable.hpp"
+#include "pool.hpp"
 
 namespace CS {
 
@@ -16,15 +19,26 @@ namespace CS {
         class TokenNode;
         typedef TokenNode SyntaxTree;
 
+        /* the name standing for every array element, as an input of an expression */
+        const char kElements[] = "[]";
+
         class TokenNode {
             public:
                 /* constructors */
-                TokenNode(const string& token_value, int token_type):
+                TokenNode(const string& token_value, int token_type, int offset = -1):
                     value_(token_value), 
                     type_(token_type),
+                    offset_(offset),
                     left_(nullptr),
                     right_(nullptr),
-                    next_(nullptr) {
+                    next_(nullptr),
+                    refs_(1),
+                    shared_(false),
+                    memo_stamp_(-1),
+                    scope_(-1),
+                    slot_(0),
+                    cache_(nullptr),
+                    cache_version_(0) {
                     }
 
                 TokenNode():
@@ -33,16 +47,36 @@ namespace CS {
 
 
                 TokenNode(const TokenPair& token):
-                    TokenNode(token.first, token.second) {
+                    TokenNode(token.first, token.second, token.offset) {
                     }
 
                 ~TokenNode() {
 #ifndef NDEBUG
                     printf("destruct tokennode\n");
 #endif
-                    if (left_) delete left_;
-                    if (right_) delete right_;
-                    if (next_) delete next_;
+                    Release(left_);
+                    Release(right_);
+                    Release(next_);
+                }
+
+                /* a node per token, so they come from the pool */
+                static void* operator new(size_t size) {
+                    return Pool::Allocate(size);
+                }
+
+                static void operator delete(void* memory, size_t size) {
+                    Pool::Free(memory, size);
+                }
+
+                /* a shared node is freed with its last owner */
+                static TokenNode* Retain(TokenNode* node) {
+                    if (node) ++node->refs_;
+                    return node;
+                }
+
+                static void Release(TokenNode* node) {
+                    if (node && --node->refs_ == 0)
+                        delete node;
                 }
 
                 /* operations */
@@ -69,40 +103,64 @@ namespace CS {
 
                 string value_;
                 int type_;
+                int offset_; // byte offset of the token in the source, -1 if unknown
                 TokenNode* left_;
                 TokenNode* right_;
                 TokenNode* next_;
+
+                /* set by a sharing parser, see Parser::Intern */
+                int refs_;
+                bool shared_; // may have several parents, so it is never changed
+                vector<string> inputs_; // variables read by the subtree, sorted
+                Variable memo_; // last value, see Evaluator::Expression
+                long memo_stamp_; // when memo_ was computed, -1 for never
+
+                /* where a variable inside braces lives, see Evaluator::Resolve */
+                int scope_; // scopes out from the innermost one, -1 for a global
+                int slot_; // index in that scope
+
+                /* the global or builtin the node names, see Block::Global */
+                const void* cache_;
+                long cache_version_; // of the names cache_ was found in, 0 for never
         };
 
         class Parser {
 
             public:
-                // trivial constructor
-                Parser():token_list_(nullptr), token_parsed_(0) {}
-
-                SyntaxTree* Parse(TokenList& token_list) {
+                /*
+                 * A sharing parser hash-conses pure expressions, so equal subtrees
+                 * become one node, also across Parse calls. Offsets of shared nodes
+                 * are those of their first occurrence, so it is left to the evaluator.
+                 */
+                Parser(bool share = false):token_list_(nullptr), token_parsed_(0),
+                    diagnostics_(nullptr), panic_(false), share_(share), nested_(0), unique_() {}
+
+                ~Parser() {
+                    Forget();
+                }
+
+                /* drop the table of shared nodes, the trees using them keep them alive */
+                void Forget() {
+                    for (auto& i: unique_)
+                        TokenNode::Release(i.second);
+                    unique_.clear();
+                }
+
+                /*
+                 * A statement with an error is reported and left out of the tree,
+                 * then parsing goes on after the next ';'.
+                 */
+                SyntaxTree* Parse(TokenList& token_list, Diagnostics* diagnostics = nullptr) {
+                    CS_TRACE_SCOPE("parse");
                     token_list_ = &token_list;
                     token_parsed_ = 0;
-                    SyntaxTree guard;
-                    TokenNode* cursor = &guard;
-
-                    while (HasNext()) {
-                        int position = Position();
-                        if (IsStatement(position)) {
-                            cursor->PushNext(Statement());
-                        } else if (IsAssignment(position)) {
-                            cursor->PushNext(Assignment());
-                        } else {
-                            cursor->PushNext(Expression());
-                        }
-                        SkipToken(";");
-                        cursor = cursor->next_;
-                    }
-
-                    /* to protect the tree be destructed by the destruction of 'guard' */
-                    TokenNode* res = guard.next_;
-                    guard.next_ = nullptr;
-                    return res;
+                    diagnostics_ = diagnostics;
+                    panic_ = false;
+                    nested_ = 0;
+                    SyntaxTree* tree = Statements();
+                    /* a node is made of each token consumed */
+                    CS_TRACE_COUNT("nodes", token_parsed_);
+                    return tree;
                 }
 
             private:
@@ -142,8 +200,15 @@ namespace CS {
                 }
 
                 inline bool IsNumber(const TokenPair& token){
-                    return token.second == GetId("int") ||
-                        token.second == GetId("double");
+                    static const int int_id = GetId("int");
+                    static const int double_id = GetId("double");
+                    return token.second == int_id ||
+                        token.second == double_id;
+                }
+
+                inline bool IsString(const TokenPair& token) {
+                    static const int string_id = GetId("string_type");
+                    return token.second == string_id;
                 }
 
                 inline bool IsIdentifier(int index) {
@@ -157,35 +222,26 @@ namespace CS {
                 bool IsStatement(int index) {
                     auto& token = GetToken(index);
                     return (token.second == 36 ||
-                            token.second == 37) &&
-                        HasNext(index) &&
-                        IsIdentifier(index+1);
+                            token.second == 37 ||
+                            token.second == 39) &&
+                        HasNext(index + 1) &&
+                        (IsIdentifier(index+1) || NextToken(index).first == "[");
                 }
 
                 bool IsAssignment(int index) {
                     auto& token = GetToken(index);
                     return IsIdentifier(index) &&
-                        HasNext(index) &&
+                        HasNext(index + 1) &&
                         NextToken(index).first == "=";
                 }
 
                 bool IsCall(int index) {
                     auto& token = GetToken(index);
                     return IsIdentifier(index) &&
-                        HasNext(index) &&
+                        HasNext(index + 1) &&
                         NextToken(index).first == "(";
                 }
 
-                bool IsValue(int index) {
-                    auto& token = GetToken(index);
-                    return (token.first == "(" && 
-                            HasNext(index) &&
-                            IsValue(index+1)) ||
-                        IsNumber(index) ||
-                        IsIdentifier(index) ||
-                        IsCall(index);
-                }
-
                 // control the token list
                 inline void Next() {
                     ++token_parsed_;
@@ -199,23 +255,23 @@ namespace CS {
                     return token_parsed_;
                 }
 
-                inline pair<string, int>& NextToken() {
+                inline TokenPair& NextToken() {
                     return (*token_list_)[token_parsed_+1];
                 }
 
-                inline pair<string, int>& NextToken(int index) {
+                inline TokenPair& NextToken(int index) {
                     return (*token_list_)[index+1];
                 }
 
-                inline pair<string, int>& Consume() {
+                inline TokenPair& Consume() {
                     return (*token_list_)[token_parsed_++];
                 }
 
-                inline pair<string, int>& GetToken() {
+                inline TokenPair& GetToken() {
                     return (*token_list_)[token_parsed_];
                 }
 
-                inline pair<string, int>& GetToken(int index) {
+                inline TokenPair& GetToken(int index) {
                     return (*token_list_)[index];
                 }
 
@@ -227,183 +283,357 @@ namespace CS {
                     return index < token_list_->size();
                 }
 
-                void SkipToken(const char* token) {
-                    assert(Consume().first == token);
+                bool SkipToken(const char* token) {
+                    if (!HasNext() || GetToken().first != token) {
+                        Error(string("expected '") + token + "'");
+                        return false;
+                    }
+                    Consume();
+                    return true;
+                }
+
+                // error recovery
+
+                void Error(const string& message) {
+                    int offset = -1;
+                    if (HasNext())
+                        offset = GetToken().offset;
+                    else if (!token_list_->empty())
+                        offset = token_list_->back().offset + token_list_->back().first.size();
+                    Report(diagnostics_, offset, message);
+                    panic_ = true;
+                }
+
+                /* skip the rest of a broken statement, up to and including ';', or up to a closing '}' */
+                void Synchronize() {
+                    while (HasNext() && !(nested_ && GetToken().first == "}") &&
+                            Consume().first != ";")
+                        ;
+                    panic_ = false;
                 }
 
-                // operator priority
+                // operator priority, 0 for a token which is not a binary operator
 
-                int Priority(char ch) {
-                    switch (ch) {
-                        case '+':
-                        case '-':
+                int Priority(const TokenPair& token) {
+                    switch (token.second) {
+                        /* == != */
+                        case 15:
+                        case 16:
                             return 1;
-                        case '*':
-                        case '/':
-                        case '%':
+                        /* + - */
+                        case 10:
+                        case 11:
                             return 2;
-                        case '(':
+                        /* * / */
+                        case 12:
+                        case 13:
                             return 3;
                         default:
-                            assert(false);
+                            return 0;
                     }
-                    /* impossibale */
-                    return -1;
                 }
 
                 // main force
 
+                /* statements up to the end of the input, or up to the '}' closing a block */
+                TokenNode* Statements() {
+                    SyntaxTree guard;
+                    TokenNode* cursor = &guard;
+
+                    while (HasNext() && !(nested_ && GetToken().first == "}")) {
+                        int position = Position();
+                        TokenNode* node;
+                        if (GetToken().first == "{") {
+                            node = Scope();
+                        } else {
+                            if (IsStatement(position)) {
+                                node = Statement();
+                            } else if (IsAssignment(position)) {
+                                node = Assignment();
+                            } else {
+                                node = Expression();
+                                /* an element on the left of '=' */
+                                if (node && node->type_ == GetId("[") &&
+                                        HasNext() && GetToken().first == "=")
+                                    node = Assignment(node);
+                            }
+                            if (node)
+                                SkipToken(";");
+                        }
+                        if (panic_) {
+                            TokenNode::Release(node);
+                            Synchronize();
+                            continue;
+                        }
+                        cursor->PushNext(Own(node));
+                        cursor = cursor->next_;
+                    }
+
+                    /* to protect the tree be destructed by the destruction of 'guard' */
+                    TokenNode* res = guard.next_;
+                    guard.next_ = nullptr;
+                    return res;
+                }
+
+                /*
+                 * '{' statements '}', the statements hang on the left of the '{' node.
+                 * Nothing inside is shared, the same name may be another variable there.
+                 */
+                SyntaxTree* Scope() {
+                    SyntaxTree* block = new SyntaxTree(Consume());
+                    ++nested_;
+                    block->PushLeft(Statements());
+                    --nested_;
+                    if (!SkipToken("}")) {
+                        TokenNode::Release(block);
+                        return nullptr;
+                    }
+                    return block;
+                }
+
+                // an array has its size on the right, as in 'int[n] a'
                 SyntaxTree* Statement() {
                     SyntaxTree* type = new SyntaxTree(Consume());
+                    if (GetToken().first == "[") {
+                        Consume();
+                        TokenNode* size = Expression();
+                        type->PushRight(size);
+                        if (!size || !SkipToken("]")) {
+                            TokenNode::Release(type);
+                            return nullptr;
+                        }
+                        if (!HasNext() || !IsIdentifier(Position())) {
+                            Error("expected a name");
+                            TokenNode::Release(type);
+                            return nullptr;
+                        }
+                    }
                     TokenNode* id = new SyntaxTree(Consume());
                     type->PushLeft(id);
                     return type;
                 }
 
                 SyntaxTree* Assignment() {
-                    SyntaxTree* id = new SyntaxTree(Consume());
+                    return Assignment(Intern(new SyntaxTree(Consume())));
+                }
+
+                SyntaxTree* Assignment(TokenNode* target) {
                     TokenNode* equal = new SyntaxTree(Consume());
+                    equal->PushLeft(target);
                     TokenNode* expr = Expression();
-                    equal->PushLeft(id);
+                    if (!expr) {
+                        TokenNode::Release(equal);
+                        return nullptr;
+                    }
                     equal->PushRight(expr);
                     return equal;
                 }
 
+                // arguments are expressions separated by ',', linked through next_
                 TokenNode* Arguments() {
-                    TokenNode* root = nullptr;
-                    enum State { ZERO, ONE, TWO };
-                    State state = ZERO;
-                    while (HasNext() && state != TWO) {
-                        int position = Position();
-                        switch (state) {
-                            case ZERO:
-                                if (IsValue(position)) {
-                                    if (root == nullptr)
-                                        root = Value();
-                                    else
-                                        root->PushFront(Value());
-                                    state = TWO;
-                                } else {
-                                    std::cerr << "not a value" << std::endl;
-                                    exit(3);
-                                }
-                                break;
-                            case ONE:
-                                if (GetToken().first == ",") {
-                                    SkipToken(",");
-                                    state = ZERO;
-                                } else {
-                                    state = TWO;
-                                }
-                                break;
-                            case TWO:
-                                goto end;
-                            default:
-                                assert(false);
-                        }
-                    }
-end:
+                    TokenNode guard;
+                    TokenNode* cursor = &guard;
+                    if (HasNext() && GetToken().first == ")")
+                        return nullptr;
+                    do {
+                        TokenNode* arg = Expression();
+                        /* 'guard' frees the arguments parsed so far */
+                        if (!arg) return nullptr;
+                        cursor->PushNext(Own(arg));
+                        cursor = cursor->next_;
+                    } while (HasNext() && GetToken().first == "," && SkipToken(","));
+                    TokenNode* root = guard.next_;
+                    guard.next_ = nullptr;
                     return root;
                 }
 
+                // nullptr after an error
                 TokenNode* Value() {
+                    if (!HasNext()) {
+                        Error("not a value: end of input");
+                        return nullptr;
+                    }
                     auto& token = GetToken();
                     TokenNode* node;
                     if (token.first == "(") {
                         SkipToken("(");
-                        node = Value();
-                        SkipToken(")");
-                    } else {
-                        if (IsNumber(Position())) {
-                            node = new TokenNode(Consume());
-                        } else if (IsCall(Position())) {
-                            node = new TokenNode;
-                            node->type_ = GetId("call_type");
-                            // function identifier
-                            node->PushLeft(new TokenNode(Consume()));
-                            // '('
-                            SkipToken("(");
-                            // expr
-                            node->PushRight(Arguments());
-                            // ')'
-                            SkipToken(")");
-                        } else if (IsIdentifier(Position())) {
-                            node = new TokenNode(Consume());
-                        } else {
-                            std::cerr << "not a value" << std::endl;
-                            exit(3);
+                        node = Expression();
+                        if (node && !SkipToken(")")) {
+                            TokenNode::Release(node);
+                            return nullptr;
+                        }
+                    } else if (IsNumber(Position()) || IsString(token)) {
+                        node = Intern(new TokenNode(Consume()));
+                    } else if (IsCall(Position())) {
+                        node = new TokenNode("", GetId("call_type"), token.offset);
+                        // function identifier
+                        node->PushLeft(new TokenNode(Consume()));
+                        // '('
+                        SkipToken("(");
+                        // expr
+                        node->PushRight(Arguments());
+                        // ')'
+                        if (panic_ || !SkipToken(")")) {
+                            TokenNode::Release(node);
+                            return nullptr;
                         }
+                    } else if (IsIdentifier(Position())) {
+                        node = Index(Intern(new TokenNode(Consume())));
+                    } else {
+                        Error("not a value: \'" + token.first + "\'");
+                        return nullptr;
                     }
                     return node;
                 }
 
-                SyntaxTree* Expression() {
-                    std::vector<TokenNode*> tokens;
-                    enum State { ZERO, ONE, TWO};
-                    State state = ZERO;
-                    while (HasNext() && state != TWO) {
-                        int position = Position();
-                        switch (state) {
-                            case ZERO:
-                                if (IsValue(position)) {
-                                    tokens.push_back(Value());
-                                } else {
-                                    std::cerr << "not a value:\t\'" << GetToken(position).first << "\'"<< std::endl;
-                                    exit(2);
-                                }
-                                state = ONE;
-                                break;
-                            case ONE:
-                                if (IsBinaryOperator(position)) {
-                                    tokens.push_back(new TokenNode(Consume()));
-                                    state = ZERO;
-                                } else {
-                                    state = TWO;
-                                }
-                                break;
-                            case TWO:
-                            default:
-                                assert(false);
+                // elements, as in 'a[i]', nullptr after an error
+                TokenNode* Index(TokenNode* node) {
+                    while (node && HasNext() && GetToken().first == "[") {
+                        TokenNode* index = new TokenNode(Consume());
+                        index->PushLeft(node);
+                        TokenNode* position = Expression();
+                        index->PushRight(position);
+                        if (!position || !SkipToken("]")) {
+                            TokenNode::Release(index);
+                            return nullptr;
                         }
+                        node = Intern(index);
                     }
-                    // convert it to postfix
-                    std::vector<TokenNode*> postfix;
-                    std::stack<TokenNode*> operators;
-                    for (auto node : tokens) {
-                        char ch = node->value_.front();
-                        if (IsBinaryOperator(node->value_)) {
-                            while (!operators.empty() && operators.top()->value_ != "(" &&
-                                    Priority(ch) <= Priority(operators.top()->value_.front())) {
-                                postfix.push_back(operators.top()), operators.pop();
-                            }
-                            operators.push(node);
-                        } else {
-                            postfix.push_back(node);
-                        }
+                    return node;
+                }
+
+                // unary minus: folded into a number, or an operator without left operand
+                TokenNode* Unary() {
+                    if (!HasNext() || GetToken().first != "-")
+                        return Value();
+                    TokenNode* minus = new TokenNode(Consume());
+                    TokenNode* operand = Unary();
+                    if (!operand) {
+                        TokenNode::Release(minus);
+                        return nullptr;
                     }
-                    while (!operators.empty()) 
-                        postfix.push_back(operators.top()), operators.pop();
-
-                    // construct syntax tree from postfix expression
-                    std::stack<TokenNode*> node_stack;
-                    for (auto &node : postfix) {
-                        if (IsOperator(node->value_)) {
-                            TokenNode* rhs = node_stack.top(); 
-                            node_stack.pop();
-                            TokenNode* lhs = node_stack.top();
-                            node_stack.pop();
-                            node->PushLeft(lhs);
-                            node->PushRight(rhs);
-                            node_stack.push(node);
-                        } else {
-                            node_stack.push(node);
+                    bool literal = operand->type_ == GetId("int") ||
+                        operand->type_ == GetId("double");
+                    if (literal && operand->value_.front() != '-') {
+                        /* a new literal, the operand may be shared */
+                        TokenNode* number = new TokenNode("-" + operand->value_,
+                                operand->type_, minus->offset_);
+                        TokenNode::Release(operand);
+                        TokenNode::Release(minus);
+                        return Intern(number);
+                    }
+                    minus->PushRight(operand);
+                    return Intern(minus);
+                }
+
+                /*
+                 * Precedence climbing: the tree is built while reading the tokens,
+                 * operators of the same priority are consumed by the loop (left associative),
+                 * and only a tighter operator or '(' recurses.
+                 */
+                SyntaxTree* Expression(int min_priority = 1) {
+                    TokenNode* lhs = Unary();
+                    while (lhs && HasNext()) {
+                        int priority = Priority(GetToken());
+                        if (priority < min_priority || priority == 0)
+                            break;
+                        TokenNode* op = new TokenNode(Consume());
+                        op->PushLeft(lhs);
+                        TokenNode* rhs = Expression(priority + 1);
+                        if (!rhs) {
+                            TokenNode::Release(op);
+                            return nullptr;
                         }
+                        op->PushRight(rhs);
+                        lhs = Intern(op);
+                    }
+                    return lhs;
+                }
+
+                // hash-consing
+
+                /*
+                 * Return the node already built for an equal subtree, or make 'node' that one.
+                 * The children are shared already, so comparing them by address is enough.
+                 * Calls and anything above them are left unshared, they are not pure.
+                 */
+                TokenNode* Intern(TokenNode* node) {
+                    if (!share_ || nested_ || node->type_ == GetId("call_type") ||
+                            (node->left_ && !node->left_->shared_) ||
+                            (node->right_ && !node->right_->shared_))
+                        return node;
+                    NodeKey key = { node->type_, node->value_, node->left_, node->right_ };
+                    auto found = unique_.find(key);
+                    if (found != unique_.end()) {
+                        TokenNode::Release(node);
+                        return TokenNode::Retain(found->second);
+                    }
+                    if (node->type_ == GetId("identifier_type")) {
+                        node->inputs_.push_back(node->value_);
+                    } else {
+                        static const vector<string> none;
+                        const vector<string>& left = node->left_ ? node->left_->inputs_ : none;
+                        const vector<string>& right = node->right_ ? node->right_->inputs_ : none;
+                        std::set_union(left.begin(), left.end(), right.begin(), right.end(),
+                                std::back_inserter(node->inputs_));
+                    }
+                    /* an element is written without writing the variable, see Evaluator::Store */
+                    if (node->type_ == GetId("[")) {
+                        auto at = std::lower_bound(node->inputs_.begin(), node->inputs_.end(),
+                                string(kElements));
+                        if (at == node->inputs_.end() || *at != kElements)
+                            node->inputs_.insert(at, kElements);
                     }
-                    return node_stack.top();
+                    node->shared_ = true;
+                    /* the table is bounded, old nodes live on in the trees using them */
+                    if (unique_.size() >= kMaxShared)
+                        Forget();
+                    unique_.emplace(key, TokenNode::Retain(node));
+                    return node;
                 }
 
+                /* a node linked through next_ must have a single parent */
+                TokenNode* Own(TokenNode* node) {
+                    if (!node || !node->shared_)
+                        return node;
+                    TokenNode* copy = new TokenNode(node->value_, node->type_, node->offset_);
+                    copy->PushLeft(TokenNode::Retain(node->left_));
+                    copy->PushRight(TokenNode::Retain(node->right_));
+                    copy->cache_ = node->cache_;
+                    copy->cache_version_ = node->cache_version_;
+                    TokenNode::Release(node);
+                    return copy;
+                }
+
+                struct NodeKey {
+                    int type;
+                    string value;
+                    const TokenNode* left;
+                    const TokenNode* right;
+
+                    bool operator == (const NodeKey& rhs) const {
+                        return type == rhs.type && left == rhs.left &&
+                            right == rhs.right && value == rhs.value;
+                    }
+                };
+
+                struct NodeHash {
+                    size_t operator () (const NodeKey& key) const {
+                        size_t h = std::hash<string>()(key.value) ^ key.type;
+                        h = h * 31 + std::hash<const TokenNode*>()(key.left);
+                        return h * 31 + std::hash<const TokenNode*>()(key.right);
+                    }
+                };
+
+                static const size_t kMaxShared = 1 << 16;
+
                 TokenList* token_list_;
                 int token_parsed_;
+                Diagnostics* diagnostics_;
+                bool panic_; // an error is found in the current statement
+                bool share_;
+                int nested_; // blocks open around the current token
+                std::unordered_map<NodeKey, TokenNode*, NodeHash> unique_;
         };
 }
 #endif
@@ -0,0 +1,226 @@
+/**
+ * A pool for the small objects made and dropped all the time: syntax tree nodes,
+ * interned strings, the arguments of a call.
+ * Sizes up to 256 bytes are rounded up to a class of 16 bytes, and each thread keeps
+ * a free list per class, carved out of 64KB blocks, so most allocations are a pop
+ * without a lock. Blocks are never given back; the lists of a thread which ends go to
+ * a depot the other threads draw from, so an object may be freed by any thread.
+ */
+
+#ifndef POOL_HPP
+#define POOL_HPP
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace CS {
+    namespace Pool {
+        const size_t kGranule = 16;
+        const size_t kClasses = 16;
+        const size_t kMaxSize = kGranule * kClasses; // larger ones go to malloc
+        const size_t kBlock = 64 << 10;
+
+        struct Stats {
+            long allocations; // served by the pool
+            long frees;
+            long blocks; // mallocs made to refill the pool
+            long large; // mallocs made for sizes over kMaxSize
+        };
+
+        struct FreeNode {
+            FreeNode* next;
+        };
+
+        inline size_t Class(size_t size) {
+            return size ? (size - 1) / kGranule : 0;
+        }
+
+        /* shared by every thread, behind a lock */
+        class Depot {
+            public:
+                /* never destroyed, objects may still be freed by other static destructors */
+                static Depot& Instance() {
+                    static Depot* depot = new Depot();
+                    return *depot;
+                }
+
+                void* NewBlock() {
+                    void* block = malloc(kBlock);
+                    if (block == nullptr)
+                        throw std::bad_alloc();
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    blocks_.push_back(block);
+                    return block;
+                }
+
+                /* a whole list, nullptr if there is none of the class, without locking then */
+                FreeNode* Take(size_t cls) {
+                    if (!lists_[cls].load(std::memory_order_relaxed))
+                        return nullptr;
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    return lists_[cls].exchange(nullptr);
+                }
+
+                void Give(size_t cls, FreeNode* list) {
+                    if (!list) return;
+                    FreeNode* last = list;
+                    while (last->next)
+                        last = last->next;
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    last->next = lists_[cls].load();
+                    lists_[cls].store(list);
+                }
+
+            private:
+                Depot() {
+                    for (auto& list: lists_)
+                        list.store(nullptr);
+                }
+
+                std::mutex mutex_;
+                std::vector<void*> blocks_; // so they are still reachable
+                std::atomic<FreeNode*> lists_[kClasses];
+        };
+
+        class Cache {
+            public:
+                Cache(): lists_(), top_(nullptr), end_(nullptr), stats_() {}
+
+                ~Cache() {
+                    for (size_t cls = 0; cls < kClasses; cls++)
+                        Depot::Instance().Give(cls, lists_[cls]);
+                    Gone() = true;
+                }
+
+                void* Allocate(size_t size) {
+                    if (size > kMaxSize) {
+                        ++stats_.large;
+                        return Large(size);
+                    }
+                    ++stats_.allocations;
+                    size_t cls = Class(size);
+                    if (!lists_[cls])
+                        lists_[cls] = Depot::Instance().Take(cls);
+                    if (FreeNode* node = lists_[cls]) {
+                        lists_[cls] = node->next;
+                        return node;
+                    }
+                    size_t bytes = (cls + 1) * kGranule;
+                    if (top_ + bytes > end_) {
+                        /* the rest of the old block is lost, it is less than kMaxSize */
+                        top_ = static_cast<char*>(Depot::Instance().NewBlock());
+                        end_ = top_ + kBlock;
+                        ++stats_.blocks;
+                    }
+                    void* memory = top_;
+                    top_ += bytes;
+                    return memory;
+                }
+
+                void Free(void* memory, size_t size) {
+                    if (size > kMaxSize) {
+                        free(memory);
+                        return;
+                    }
+                    ++stats_.frees;
+                    FreeNode* node = static_cast<FreeNode*>(memory);
+                    size_t cls = Class(size);
+                    node->next = lists_[cls];
+                    lists_[cls] = node;
+                }
+
+                const Stats& Statistics() const {
+                    return stats_;
+                }
+
+                static void* Large(size_t size) {
+                    void* memory = malloc(size);
+                    if (memory == nullptr)
+                        throw std::bad_alloc();
+                    return memory;
+                }
+
+                /* the cache of this thread is destroyed, as it ends */
+                static bool& Gone() {
+                    static thread_local bool gone = false;
+                    return gone;
+                }
+
+            private:
+                FreeNode* lists_[kClasses];
+                char* top_;
+                char* end_;
+                Stats stats_;
+        };
+
+        inline Cache& Local() {
+            static thread_local Cache cache;
+            return cache;
+        }
+
+        /* 'size' must be given back to Free as it was given here */
+        inline void* Allocate(size_t size) {
+            if (Cache::Gone())
+                return Cache::Large(size > kMaxSize ? size : (Class(size) + 1) * kGranule);
+            return Local().Allocate(size);
+        }
+
+        inline void Free(void* memory, size_t size) {
+            if (!memory) return;
+            if (Cache::Gone()) {
+                if (size > kMaxSize) {
+                    free(memory);
+                } else {
+                    FreeNode* node = static_cast<FreeNode*>(memory);
+                    node->next = nullptr;
+                    Depot::Instance().Give(Class(size), node);
+                }
+                return;
+            }
+            Local().Free(memory, size);
+        }
+
+        /* of this thread */
+        inline const Stats& Statistics() {
+            return Local().Statistics();
+        }
+
+        /* for the containers of temporaries */
+        template <typename T>
+        struct Allocator {
+            typedef T value_type;
+
+            Allocator() {}
+
+            template <typename U>
+            Allocator(const Allocator<U>&) {}
+
+            T* allocate(size_t n) {
+                return static_cast<T*>(Allocate(n * sizeof(T)));
+            }
+
+            void deallocate(T* p, size_t n) {
+                Free(p, n * sizeof(T));
+            }
+
+            template <typename U>
+            struct rebind {
+                typedef Allocator<U> other;
+            };
+        };
+
+        template <typename T, typename U>
+        bool operator == (const Allocator<T>&, const Allocator<U>&) {
+            return true;
+        }
+
+        template <typename T, typename U>
+        bool operator != (const Allocator<T>&, const Allocator<U>&) {
+            return false;
+        }
+    }
+}
+#endif
@@ -8,11 +8,28 @@
 #include <cassert>
 #include <iostream>
 #include <unordered_map>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+
+#include "diagnostic.hpp"
+#include "trace.hpp"
 
 namespace CS {
         using std::string;
 
-        typedef std::pair<string, int> TokenPair;
+        /* a token keeps the interface of a pair, plus where it starts in the source */
+        struct TokenPair : std::pair<string, int> {
+            TokenPair(): offset(-1) {}
+
+            TokenPair(const string& value, int type, int position = -1):
+                std::pair<string, int>(value, type), offset(position) {
+                }
+
+            int offset;
+        };
+
         typedef std::vector<TokenPair> TokenList;
         typedef std::unordered_map<string, int> TokenMap;
 
@@ -20,7 +37,9 @@ namespace CS {
             static TokenMap types = {
                 { "int", 1 },
                 { "double", 2 },
-                { "pointer", 3}
+                { "pointer", 3},
+                { "string", 4 },
+                { "array", 5 }
             };
             return types;
         }
@@ -37,7 +56,12 @@ namespace CS {
                 { "\"", 17 },
                 { "(", 18 },
                 { ")", 19 },
-                { ";", 20 }
+                { ";", 20 },
+                { ",", 21 },
+                { "{", 22 },
+                { "}", 23 },
+                { "[", 24 },
+                { "]", 25 }
             };
             return operators;
         }
@@ -50,7 +74,8 @@ namespace CS {
                 { "while", 34 },
                 { "for", 35 },
                 { "int", 36 },
-                { "double", 37}
+                { "double", 37},
+                { "string", 39 }
             };
             return keywords;
         }
@@ -66,26 +91,43 @@ namespace CS {
         }
 
         class Scanner {
-            enum State { START, NUMBER, PUNCT, LETTER, DONE };
+            enum State { START, NUMBER, PUNCT, LETTER, STRING, ESCAPE, DONE };
             public:
             Scanner() {}
 
 
-            static TokenList Scan(const string& s) {
-                return Scan(s.c_str());
+            static TokenList Scan(const string& s, Diagnostics* diagnostics = nullptr) {
+                return Scan(s.c_str(), diagnostics);
             }
 
-            static TokenList Scan(const char* s) {
+            /* an undefined token is reported and left out */
+            static TokenList Scan(const char* s, Diagnostics* diagnostics = nullptr) {
+                return Scan(s, 0, strlen(s), diagnostics);
+            }
+
+            /* scan source[begin, end), the offsets of the tokens count from 'source' */
+            static TokenList Scan(const char* source, size_t begin, size_t end,
+                    Diagnostics* diagnostics = nullptr) {
+                CS_TRACE_SCOPE("scan");
                 TokenList tokens;
                 string token;
                 State state = START;
                 char ch;
+                const char* s = source + begin;
+                const char* stop = source + end;
+                int start = 0;
 
-                while (*s != '\0') {
+                while (s != stop) {
                     ch = *s++;
 begin:
                     switch (state) {
                         case START:
+                            start = s - 1 - source;
+                            /* the quotes are not part of a string token */
+                            if (ch == '"') {
+                                state = STRING;
+                                break;
+                            }
                             token += ch;
                             if (ispunct(ch)) 
                                 state = PUNCT;
@@ -100,16 +142,16 @@ begin:
                             if (isdigit(ch) || ch == '.') {
                                 token += ch;
                             } else {
-                                Restart(state, token, tokens);
+                                Restart(state, token, tokens, start, diagnostics);
                                 goto begin;
                             }
                             break;
                         case PUNCT:
-                            // avoid this condition: println("hello");
-                            if (ch != ';' && ispunct(ch)) {
+                            // only grow into a known operator such as '==', so ')*' or '((' stay apart
+                            if (IsOperator(token + ch)) {
                                 token += ch;
                             } else {
-                                Restart(state, token, tokens);
+                                Restart(state, token, tokens, start, diagnostics);
                                 goto begin;
                             }
                             break;
@@ -117,23 +159,60 @@ begin:
                             if (isalpha(ch)) {
                                 token += ch;
                             } else {
-                                Restart(state, token, tokens);
+                                Restart(state, token, tokens, start, diagnostics);
                                 goto begin;
                             }
                             break;
+                        case STRING:
+                            if (ch == '"') {
+                                tokens.emplace_back(token, kLiterals()["string_type"], start);
+                                token.clear();
+                                state = START;
+                            } else if (ch == '\\') {
+                                state = ESCAPE;
+                            } else {
+                                token += ch;
+                            }
+                            break;
+                        case ESCAPE:
+                            switch (ch) {
+                                case 'n':
+                                    token += '\n';
+                                    break;
+                                case 't':
+                                    token += '\t';
+                                    break;
+                                default:
+                                    /* '\"' and '\\' */
+                                    token += ch;
+                            }
+                            state = STRING;
+                            break;
                         case DONE:
                             break;
                         default:
                             assert(false);
                     }
                 }
+                /* the last token, when the source does not end with a blank */
+                if (state == STRING || state == ESCAPE)
+                    Report(diagnostics, start, "unterminated string");
+                else if (state != START)
+                    Restart(state, token, tokens, start, diagnostics);
+                CS_TRACE_COUNT("tokens", tokens.size());
                 return tokens;
             }
 
-            static void Restart(State& state, string& token, TokenList& tokens) {
+            static void Restart(State& state, string& token, TokenList& tokens,
+                    int start, Diagnostics* diagnostics) {
                 state = START;
                 int type_id = IdentifyToken(token);
-                tokens.emplace_back(token, type_id);
+                if (type_id < 0)
+                    Report(diagnostics, start, "undefined token " + token);
+                else if (!InRange(token, type_id))
+                    Report(diagnostics, start, "number out of range: " + token);
+                else
+                    tokens.emplace_back(token, type_id, start);
                 token.clear();
             }
 
@@ -142,14 +221,30 @@ begin:
             }
 
             static bool IsNumber(const string& token) {
-                return !token.empty() && 
-                    std::all_of(token.begin(), token.end(), isdigit);
+                return !token.empty() && isdigit(token.front()) &&
+                    std::count(token.begin(), token.end(), '.') <= 1 &&
+                    std::all_of(token.begin(), token.end(),
+                            [](char ch) { return isdigit(ch) || ch == '.'; });
             }
 
             static bool IsDouble(const string& token) {
                 return token.find('.') != token.npos;
             }
 
+            /* a number the later stages can convert, anything else is in range */
+            static bool InRange(const string& token, int type_id) {
+                errno = 0;
+                if (type_id == kTypes()["int"]) {
+                    long long value = strtoll(token.c_str(), nullptr, 10);
+                    return errno != ERANGE && value <= INT_MAX;
+                }
+                if (type_id == kTypes()["double"]) {
+                    strtod(token.c_str(), nullptr);
+                    return errno != ERANGE;
+                }
+                return true;
+            }
+
             static bool IsLetter(const string& token) {
                 return !token.empty() &&
                     isalpha(token.front()) &&
@@ -164,6 +259,7 @@ begin:
                 return kTypes().find(token) != kTypes().end();
             }
 
+            /* -1 for an undefined token */
             static int IdentifyToken(const string& token) {
                 if (IsOperator(token))
                     return kOperators()[token];
@@ -180,11 +276,9 @@ begin:
                         return kTypes()[token];
                     else
                         return kLiterals()["identifier_type"];
-                } else {
-                    std::cerr << "undefined token " << token << std::endl;
-                    exit(1);
                 }
-
+                /* undefined */
+                return -1;
             }
 
             private:
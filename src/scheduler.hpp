@@ -0,0 +1,153 @@
+/**
+ * Many vms on a few threads. Each task is a vm with its code loaded, and a worker
+ * resumes it for a quantum of instructions, then takes the next one in line, so a long
+ * script cannot hold a thread. A task blocked in a waiter is parked until Wake, and
+ * costs nothing meanwhile; its vm stays on the call and makes it again when resumed.
+ */
+
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "vm.hpp"
+
+namespace CS {
+    namespace VM {
+        class Scheduler {
+            public:
+                /* 'threads' workers, 0 for one per core, each resuming a task for 'quantum' */
+                explicit Scheduler(int threads = 0, long quantum = 1000):
+                    quantum_(quantum), live_(0), resumes_(0), stop_(false) {
+                    if (threads <= 0)
+                        threads = std::max(1u, std::thread::hardware_concurrency());
+                    for (int i = 0; i < threads; i++)
+                        workers_.emplace_back([this]() { Work(); });
+                }
+
+                /* the tasks left are dropped where they are */
+                ~Scheduler() {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        stop_ = true;
+                    }
+                    work_.notify_all();
+                    for (auto& worker: workers_)
+                        worker.join();
+                }
+
+                Scheduler(const Scheduler&) = delete;
+                Scheduler& operator = (const Scheduler&) = delete;
+
+                /* run a vm with its code loaded, see VM::Load; gives the task to Wake */
+                int Spawn(std::unique_ptr<VM> vm) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    tasks_.emplace_back(new Task(std::move(vm)));
+                    Task* task = tasks_.back().get();
+                    ++live_;
+                    queue_.push_back(task);
+                    work_.notify_one();
+                    return tasks_.size() - 1;
+                }
+
+                /* what the task waits for is there, it is resumed if it was parked */
+                void Wake(int id) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    Task* task = tasks_[id].get();
+                    if (task->state == kParked) {
+                        task->state = kQueued;
+                        queue_.push_back(task);
+                        work_.notify_one();
+                    } else if (task->state == kRunning) {
+                        /* it may be about to park, it is queued again instead */
+                        task->woken = true;
+                    }
+                }
+
+                /* until every task is done, so not while one stays parked */
+                void Wait() {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    idle_.wait(lock, [this]() { return live_ == 0; });
+                }
+
+                /* not to be touched while the task runs */
+                VM& Get(int id) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    return *tasks_[id]->vm;
+                }
+
+                bool Done(int id) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    return tasks_[id]->state == kFinished;
+                }
+
+                /* quanta run so far, by every worker */
+                long Resumes() {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    return resumes_;
+                }
+
+            private:
+                enum State {
+                    kQueued,
+                    kRunning,
+                    kParked,
+                    kFinished // not kDone, which is a Status
+                };
+
+                struct Task {
+                    explicit Task(std::unique_ptr<VM> machine):
+                        vm(std::move(machine)), state(kQueued), woken(false) {}
+
+                    std::unique_ptr<VM> vm;
+                    State state;
+                    bool woken;
+                };
+
+                void Work() {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    for (;;) {
+                        work_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+                        if (stop_)
+                            return;
+                        Task* task = queue_.front();
+                        queue_.pop_front();
+                        task->state = kRunning;
+                        task->woken = false;
+                        ++resumes_;
+                        lock.unlock();
+                        Status status = task->vm->Resume(quantum_);
+                        lock.lock();
+                        if (status == kDone) {
+                            task->state = kFinished;
+                            if (--live_ == 0)
+                                idle_.notify_all();
+                        } else if (status == kBlocked && !task->woken) {
+                            task->state = kParked;
+                        } else {
+                            /* to the back of the line, behind the others */
+                            task->state = kQueued;
+                            queue_.push_back(task);
+                        }
+                    }
+                }
+
+                long quantum_;
+                std::mutex mutex_;
+                std::condition_variable work_; // a task is queued
+                std::condition_variable idle_; // every task is done
+                std::vector<std::unique_ptr<Task>> tasks_; // by id
+                std::deque<Task*> queue_;
+                long live_; // tasks not done
+                long resumes_;
+                bool stop_;
+                std::vector<std::thread> workers_;
+        };
+    }
+}
+#endif
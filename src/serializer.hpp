@@ -36,28 +36,39 @@ namespace CS {
             fclose(output);
         }
 
+        /*
+         * The file may come from another host, so a malformed file gives
+         * a pair of nullptr instead of trusting the sizes it claims.
+         * The instructions themselves are checked by Verifier::Verify when loaded into the vm.
+         */
         static std::pair<InstructionTable*, SymbolTable*>
             Deserialize(const char* file_path) {
                 FILE* input = fopen(file_path, "r");
-                assert(input != nullptr);
+                if (input == nullptr)
+                    return std::make_pair(nullptr, nullptr);
                 size_t symb_size, inst_size;
                 auto inst_tbl = new InstructionTable();
                 auto symb_tbl = new SymbolTable();
                 char buff[100];
                 int size;
                 long long lsize;
+                bool ok = fscanf(input, "%zu %zu", &symb_size, &inst_size) == 2;
 
-                fscanf(input, "%zu %zu", &symb_size, &inst_size);
-                for (int i = 0; i < symb_size; i++) {
-                    fscanf(input, "%s %d", buff, &size);
-                    symb_tbl->emplace(buff, size);
+                for (size_t i = 0; ok && i < symb_size; i++) {
+                    ok = fscanf(input, "%99s %d", buff, &size) == 2 &&
+                        symb_tbl->emplace(buff, size).second;
                 }
-                for (int i = 0; i < inst_size; i++) {
-                    fscanf(input, "%lld", &lsize);
-                    inst_tbl->push_back(lsize);
+                for (size_t i = 0; ok && i < inst_size; i++) {
+                    ok = fscanf(input, "%lld", &lsize) == 1;
+                    if (ok) inst_tbl->push_back(lsize);
                 }
                 
                 fclose(input);
+                if (!ok) {
+                    delete inst_tbl;
+                    delete symb_tbl;
+                    return std::make_pair(nullptr, nullptr);
+                }
                 return std::make_pair(inst_tbl, symb_tbl);
             }
     }
@@ -0,0 +1,79 @@
+/**
+ * A REPL session backed by the vm instead of the evaluator.
+ * Every line is encoded against the variables of the lines before it,
+ * and only its own instructions are appended to the code the vm keeps,
+ * so nothing typed earlier is encoded or run again.
+ */
+
+#ifndef SESSION_HPP
+#define SESSION_HPP
+#include <memory>
+#include <string>
+
+#include "scanner.hpp"
+#include "parser.hpp"
+#include "encoder.hpp"
+#include "vm.hpp"
+
+namespace CS {
+    using std::shared_ptr;
+    using std::string;
+
+class Session {
+    public:
+        Session(): scanner_(), parser_(), encoder_(), vm_() {}
+
+        string Evaluate(const string& code) {
+            return Evaluate(code.c_str());
+        }
+
+        /* a line with any error runs nothing, and the errors are the result */
+        string Evaluate(const char* code) {
+            Diagnostics diagnostics;
+            TokenList&& token_list = scanner_.Scan(code, &diagnostics);
+            shared_ptr<SyntaxTree> tree(parser_.Parse(token_list, &diagnostics));
+            OpCode::InstructionTable instructions = encoder_.Append(tree.get(), &diagnostics);
+            if (!diagnostics.empty()) {
+                encoder_.Rollback();
+                string messages;
+                for (auto& i: diagnostics)
+                    messages += (messages.empty() ? "" : "\n") + i.message;
+                return messages;
+            }
+            int depth = vm_.Depth();
+            if (!vm_.Execute(instructions, encoder_.Symbols())) {
+                /* keep the encoder in step with the vm */
+                encoder_.Rollback();
+                return string();
+            }
+            /* the vm reported the fault, the variables of the line go with what it left */
+            if (vm_.Fault() >= 0) {
+                vm_.Recover(depth);
+                encoder_.Rollback();
+                return string();
+            }
+            return Result(tree.get());
+        }
+
+    private:
+        /* like the evaluator, show the variable written by the line */
+        string Result(SyntaxTree* tree) {
+            string id;
+            for (; tree; tree = tree->next_) {
+                if (tree->type_ == 36 || tree->type_ == 37 ||
+                        tree->type_ == GetId("="))
+                    id = tree->left_->value_;
+                else
+                    id.clear();
+            }
+            if (id.empty()) return string();
+            return id + " = " + std::to_string(vm_.Slot(encoder_.Slot(id)));
+        }
+
+        Scanner scanner_;
+        Parser parser_;
+        Encoder::Encoder encoder_;
+        VM::VM vm_;
+};
+}
+#endif
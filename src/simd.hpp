@@ -0,0 +1,456 @@
+/**
+ * Kernels for the array builtins, see function.hpp.
+ * Each kernel is written for AVX2, for SSE2 and in plain C++; AVX2 is chosen at
+ * run time when the cpu has it, SSE2 is always there on x86-64.
+ *
+ * An element takes 8 bytes: a double fills it, an int is in its low 4 bytes,
+ * so a vector of ints works on every other 32 bit lane and ignores the rest.
+ * Ints wrap around on overflow, in every level alike.
+ */
+
+#ifndef SIMD_HPP
+#define SIMD_HPP
+#include <cstddef>
+#include <cstdint>
+
+#include "gc.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CS_SIMD_X86 1
+#include <immintrin.h>
+#define CS_AVX2 __attribute__((target("avx2")))
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace CS {
+    namespace Simd {
+        using GC::Element;
+
+        enum Op { kAdd, kMul, kMin, kMax };
+
+        enum Level { kScalar, kSse2, kAvx2 };
+
+        namespace Scalar {
+            template <Op op>
+            inline double Apply(double a, double b) {
+                switch (op) {
+                    case kAdd: return a + b;
+                    case kMul: return a * b;
+                    case kMin: return b < a ? b : a;
+                    default: return a < b ? b : a;
+                }
+            }
+
+            template <Op op>
+            inline int Apply(int a, int b) {
+                switch (op) {
+                    case kAdd: return static_cast<int>(static_cast<uint32_t>(a) + static_cast<uint32_t>(b));
+                    case kMul: return static_cast<int>(static_cast<uint32_t>(a) * static_cast<uint32_t>(b));
+                    case kMin: return b < a ? b : a;
+                    default: return a < b ? b : a;
+                }
+            }
+
+            /* 'acc' combined with the 'n' elements */
+            template <Op op>
+            double ReduceDouble(const Element* x, size_t n, double acc) {
+                for (size_t i = 0; i < n; i++)
+                    acc = Apply<op>(acc, x[i].d);
+                return acc;
+            }
+
+            template <Op op>
+            int ReduceInt(const Element* x, size_t n, int acc) {
+                for (size_t i = 0; i < n; i++)
+                    acc = Apply<op>(acc, x[i].i);
+                return acc;
+            }
+
+            inline double DotDouble(const Element* x, const Element* y, size_t n, double acc) {
+                for (size_t i = 0; i < n; i++)
+                    acc += x[i].d * y[i].d;
+                return acc;
+            }
+
+            inline int DotInt(const Element* x, const Element* y, size_t n, int acc) {
+                for (size_t i = 0; i < n; i++)
+                    acc = Apply<kAdd>(acc, Apply<kMul>(x[i].i, y[i].i));
+                return acc;
+            }
+
+            template <Op op>
+            void MapDouble(const Element* x, const Element* y, Element* out, size_t n) {
+                for (size_t i = 0; i < n; i++)
+                    out[i].d = Apply<op>(x[i].d, y[i].d);
+            }
+
+            template <Op op>
+            void MapInt(const Element* x, const Element* y, Element* out, size_t n) {
+                for (size_t i = 0; i < n; i++)
+                    out[i].i = Apply<op>(x[i].i, y[i].i);
+            }
+
+            inline void AxpyDouble(double alpha, const Element* x, Element* y, size_t n) {
+                for (size_t i = 0; i < n; i++)
+                    y[i].d += alpha * x[i].d;
+            }
+
+            inline void AxpyInt(int alpha, const Element* x, Element* y, size_t n) {
+                for (size_t i = 0; i < n; i++)
+                    y[i].i = Apply<kAdd>(y[i].i, Apply<kMul>(alpha, x[i].i));
+            }
+        }
+
+#ifdef CS_SIMD_X86
+        namespace Avx2 {
+            template <Op op>
+            CS_AVX2 inline __m256d Apply(__m256d a, __m256d b) {
+                switch (op) {
+                    case kAdd: return _mm256_add_pd(a, b);
+                    case kMul: return _mm256_mul_pd(a, b);
+                    case kMin: return _mm256_min_pd(a, b);
+                    default: return _mm256_max_pd(a, b);
+                }
+            }
+
+            /* the low lane of each 64 bit element */
+            template <Op op>
+            CS_AVX2 inline __m256i Apply(__m256i a, __m256i b) {
+                switch (op) {
+                    case kAdd: return _mm256_add_epi32(a, b);
+                    case kMul: return _mm256_mul_epu32(a, b);
+                    case kMin: return _mm256_min_epi32(a, b);
+                    default: return _mm256_max_epi32(a, b);
+                }
+            }
+
+            CS_AVX2 inline __m256d LoadDouble(const Element* x) {
+                return _mm256_loadu_pd(&x->d);
+            }
+
+            CS_AVX2 inline __m256i LoadInt(const Element* x) {
+                return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x));
+            }
+
+            /* needs n >= 1 */
+            template <Op op>
+            CS_AVX2 double ReduceDouble(const Element* x, size_t n) {
+                if (n < 4)
+                    return Scalar::ReduceDouble<op>(x + 1, n - 1, x[0].d);
+                __m256d acc = LoadDouble(x);
+                size_t i = 4;
+                for (; i + 4 <= n; i += 4)
+                    acc = Apply<op>(acc, LoadDouble(x + i));
+                Element lanes[4];
+                _mm256_storeu_pd(&lanes[0].d, acc);
+                return Scalar::ReduceDouble<op>(x + i, n - i, Scalar::ReduceDouble<op>(lanes + 1, 3, lanes[0].d));
+            }
+
+            template <Op op>
+            CS_AVX2 int ReduceInt(const Element* x, size_t n) {
+                if (n < 4)
+                    return Scalar::ReduceInt<op>(x + 1, n - 1, x[0].i);
+                __m256i acc = LoadInt(x);
+                size_t i = 4;
+                for (; i + 4 <= n; i += 4)
+                    acc = Apply<op>(acc, LoadInt(x + i));
+                Element lanes[4];
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+                return Scalar::ReduceInt<op>(x + i, n - i, Scalar::ReduceInt<op>(lanes + 1, 3, lanes[0].i));
+            }
+
+            CS_AVX2 double DotDouble(const Element* x, const Element* y, size_t n) {
+                __m256d acc = _mm256_setzero_pd();
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4)
+                    acc = _mm256_add_pd(acc, _mm256_mul_pd(LoadDouble(x + i), LoadDouble(y + i)));
+                Element lanes[4];
+                _mm256_storeu_pd(&lanes[0].d, acc);
+                return Scalar::DotDouble(x + i, y + i, n - i,
+                        Scalar::ReduceDouble<kAdd>(lanes, 4, 0.0));
+            }
+
+            CS_AVX2 int DotInt(const Element* x, const Element* y, size_t n) {
+                __m256i acc = _mm256_setzero_si256();
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4)
+                    acc = _mm256_add_epi32(acc, _mm256_mul_epu32(LoadInt(x + i), LoadInt(y + i)));
+                Element lanes[4];
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+                return Scalar::DotInt(x + i, y + i, n - i, Scalar::ReduceInt<kAdd>(lanes, 4, 0));
+            }
+
+            template <Op op>
+            CS_AVX2 void MapDouble(const Element* x, const Element* y, Element* out, size_t n) {
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4)
+                    _mm256_storeu_pd(&out[i].d, Apply<op>(LoadDouble(x + i), LoadDouble(y + i)));
+                Scalar::MapDouble<op>(x + i, y + i, out + i, n - i);
+            }
+
+            template <Op op>
+            CS_AVX2 void MapInt(const Element* x, const Element* y, Element* out, size_t n) {
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4)
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                            Apply<op>(LoadInt(x + i), LoadInt(y + i)));
+                Scalar::MapInt<op>(x + i, y + i, out + i, n - i);
+            }
+
+            CS_AVX2 void AxpyDouble(double alpha, const Element* x, Element* y, size_t n) {
+                __m256d a = _mm256_set1_pd(alpha);
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4)
+                    _mm256_storeu_pd(&y[i].d, _mm256_add_pd(LoadDouble(y + i),
+                                _mm256_mul_pd(a, LoadDouble(x + i))));
+                Scalar::AxpyDouble(alpha, x + i, y + i, n - i);
+            }
+
+            CS_AVX2 void AxpyInt(int alpha, const Element* x, Element* y, size_t n) {
+                __m256i a = _mm256_set1_epi32(alpha);
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4)
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(y + i), _mm256_add_epi32(LoadInt(y + i),
+                                _mm256_mul_epu32(a, LoadInt(x + i))));
+                Scalar::AxpyInt(alpha, x + i, y + i, n - i);
+            }
+        }
+#endif
+
+#ifdef __SSE2__
+        namespace Sse2 {
+            template <Op op>
+            inline __m128d Apply(__m128d a, __m128d b) {
+                switch (op) {
+                    case kAdd: return _mm_add_pd(a, b);
+                    case kMul: return _mm_mul_pd(a, b);
+                    case kMin: return _mm_min_pd(a, b);
+                    default: return _mm_max_pd(a, b);
+                }
+            }
+
+            /* SSE2 has no 32 bit min, max or low multiply, so they are built from what it has */
+            template <Op op>
+            inline __m128i Apply(__m128i a, __m128i b) {
+                __m128i less;
+                switch (op) {
+                    case kAdd:
+                        return _mm_add_epi32(a, b);
+                    case kMul:
+                        return _mm_mul_epu32(a, b);
+                    case kMin:
+                        less = _mm_cmplt_epi32(a, b);
+                        return _mm_or_si128(_mm_and_si128(less, a), _mm_andnot_si128(less, b));
+                    default:
+                        less = _mm_cmplt_epi32(a, b);
+                        return _mm_or_si128(_mm_and_si128(less, b), _mm_andnot_si128(less, a));
+                }
+            }
+
+            inline __m128d LoadDouble(const Element* x) {
+                return _mm_loadu_pd(&x->d);
+            }
+
+            inline __m128i LoadInt(const Element* x) {
+                return _mm_loadu_si128(reinterpret_cast<const __m128i*>(x));
+            }
+
+            /* needs n >= 1 */
+            template <Op op>
+            double ReduceDouble(const Element* x, size_t n) {
+                if (n < 2)
+                    return x[0].d;
+                __m128d acc = LoadDouble(x);
+                size_t i = 2;
+                for (; i + 2 <= n; i += 2)
+                    acc = Apply<op>(acc, LoadDouble(x + i));
+                Element lanes[2];
+                _mm_storeu_pd(&lanes[0].d, acc);
+                return Scalar::ReduceDouble<op>(x + i, n - i, Scalar::Apply<op>(lanes[0].d, lanes[1].d));
+            }
+
+            template <Op op>
+            int ReduceInt(const Element* x, size_t n) {
+                if (n < 2)
+                    return x[0].i;
+                __m128i acc = LoadInt(x);
+                size_t i = 2;
+                for (; i + 2 <= n; i += 2)
+                    acc = Apply<op>(acc, LoadInt(x + i));
+                Element lanes[2];
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+                return Scalar::ReduceInt<op>(x + i, n - i, Scalar::Apply<op>(lanes[0].i, lanes[1].i));
+            }
+
+            inline double DotDouble(const Element* x, const Element* y, size_t n) {
+                __m128d acc = _mm_setzero_pd();
+                size_t i = 0;
+                for (; i + 2 <= n; i += 2)
+                    acc = _mm_add_pd(acc, _mm_mul_pd(LoadDouble(x + i), LoadDouble(y + i)));
+                Element lanes[2];
+                _mm_storeu_pd(&lanes[0].d, acc);
+                return Scalar::DotDouble(x + i, y + i, n - i, lanes[0].d + lanes[1].d);
+            }
+
+            inline int DotInt(const Element* x, const Element* y, size_t n) {
+                __m128i acc = _mm_setzero_si128();
+                size_t i = 0;
+                for (; i + 2 <= n; i += 2)
+                    acc = _mm_add_epi32(acc, _mm_mul_epu32(LoadInt(x + i), LoadInt(y + i)));
+                Element lanes[2];
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+                return Scalar::DotInt(x + i, y + i, n - i, Scalar::Apply<kAdd>(lanes[0].i, lanes[1].i));
+            }
+
+            template <Op op>
+            void MapDouble(const Element* x, const Element* y, Element* out, size_t n) {
+                size_t i = 0;
+                for (; i + 2 <= n; i += 2)
+                    _mm_storeu_pd(&out[i].d, Apply<op>(LoadDouble(x + i), LoadDouble(y + i)));
+                Scalar::MapDouble<op>(x + i, y + i, out + i, n - i);
+            }
+
+            template <Op op>
+            void MapInt(const Element* x, const Element* y, Element* out, size_t n) {
+                size_t i = 0;
+                for (; i + 2 <= n; i += 2)
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                            Apply<op>(LoadInt(x + i), LoadInt(y + i)));
+                Scalar::MapInt<op>(x + i, y + i, out + i, n - i);
+            }
+
+            inline void AxpyDouble(double alpha, const Element* x, Element* y, size_t n) {
+                __m128d a = _mm_set1_pd(alpha);
+                size_t i = 0;
+                for (; i + 2 <= n; i += 2)
+                    _mm_storeu_pd(&y[i].d, _mm_add_pd(LoadDouble(y + i), _mm_mul_pd(a, LoadDouble(x + i))));
+                Scalar::AxpyDouble(alpha, x + i, y + i, n - i);
+            }
+
+            inline void AxpyInt(int alpha, const Element* x, Element* y, size_t n) {
+                __m128i a = _mm_set1_epi32(alpha);
+                size_t i = 0;
+                for (; i + 2 <= n; i += 2)
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(y + i), _mm_add_epi32(LoadInt(y + i),
+                                _mm_mul_epu32(a, LoadInt(x + i))));
+                Scalar::AxpyInt(alpha, x + i, y + i, n - i);
+            }
+        }
+#endif
+
+        static Level Detect() {
+#ifdef CS_SIMD_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return kAvx2;
+#endif
+#ifdef __SSE2__
+            return kSse2;
+#else
+            return kScalar;
+#endif
+        }
+
+        /* the best level of this cpu, lowered by tests and benchmarks to compare them */
+        static Level& Current() {
+            static Level level = Detect();
+            return level;
+        }
+
+        inline bool Supported(Level level) {
+            return level <= Detect();
+        }
+
+        /* 'n' elements combined by 'op', n >= 1 */
+        template <Op op>
+        Element Reduce(bool is_double, const Element* x, size_t n) {
+            Element res;
+            switch (Current()) {
+#ifdef CS_SIMD_X86
+                case kAvx2:
+                    if (is_double) res.d = Avx2::ReduceDouble<op>(x, n);
+                    else res.i = Avx2::ReduceInt<op>(x, n);
+                    return res;
+#endif
+#ifdef __SSE2__
+                case kSse2:
+                    if (is_double) res.d = Sse2::ReduceDouble<op>(x, n);
+                    else res.i = Sse2::ReduceInt<op>(x, n);
+                    return res;
+#endif
+                default:
+                    if (is_double) res.d = Scalar::ReduceDouble<op>(x + 1, n - 1, x[0].d);
+                    else res.i = Scalar::ReduceInt<op>(x + 1, n - 1, x[0].i);
+                    return res;
+            }
+        }
+
+        static Element Dot(bool is_double, const Element* x, const Element* y, size_t n) {
+            Element res;
+            switch (Current()) {
+#ifdef CS_SIMD_X86
+                case kAvx2:
+                    if (is_double) res.d = Avx2::DotDouble(x, y, n);
+                    else res.i = Avx2::DotInt(x, y, n);
+                    return res;
+#endif
+#ifdef __SSE2__
+                case kSse2:
+                    if (is_double) res.d = Sse2::DotDouble(x, y, n);
+                    else res.i = Sse2::DotInt(x, y, n);
+                    return res;
+#endif
+                default:
+                    if (is_double) res.d = Scalar::DotDouble(x, y, n, 0.0);
+                    else res.i = Scalar::DotInt(x, y, n, 0);
+                    return res;
+            }
+        }
+
+        /* out[i] = x[i] op y[i], 'out' may be 'x' or 'y' */
+        template <Op op>
+        void Map(bool is_double, const Element* x, const Element* y, Element* out, size_t n) {
+            switch (Current()) {
+#ifdef CS_SIMD_X86
+                case kAvx2:
+                    if (is_double) Avx2::MapDouble<op>(x, y, out, n);
+                    else Avx2::MapInt<op>(x, y, out, n);
+                    return;
+#endif
+#ifdef __SSE2__
+                case kSse2:
+                    if (is_double) Sse2::MapDouble<op>(x, y, out, n);
+                    else Sse2::MapInt<op>(x, y, out, n);
+                    return;
+#endif
+                default:
+                    if (is_double) Scalar::MapDouble<op>(x, y, out, n);
+                    else Scalar::MapInt<op>(x, y, out, n);
+            }
+        }
+
+        /* y[i] += alpha * x[i] */
+        static void Axpy(bool is_double, Element alpha, const Element* x, Element* y, size_t n) {
+            switch (Current()) {
+#ifdef CS_SIMD_X86
+                case kAvx2:
+                    if (is_double) Avx2::AxpyDouble(alpha.d, x, y, n);
+                    else Avx2::AxpyInt(alpha.i, x, y, n);
+                    return;
+#endif
+#ifdef __SSE2__
+                case kSse2:
+                    if (is_double) Sse2::AxpyDouble(alpha.d, x, y, n);
+                    else Sse2::AxpyInt(alpha.i, x, y, n);
+                    return;
+#endif
+                default:
+                    if (is_double) Scalar::AxpyDouble(alpha.d, x, y, n);
+                    else Scalar::AxpyInt(alpha.i, x, y, n);
+            }
+        }
+    }
+}
+#endif
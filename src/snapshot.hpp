@@ -0,0 +1,153 @@
+/**
+ * Save the variables of an evaluator to a binary file and map them back,
+ * so a restarted REPL continues where it stopped without replaying its history.
+ *
+ * The layout is native-endian and meant for the same host:
+ *   header:  magic "CSSNAP\0\0", uint32 version, uint32 count
+ *   records: uint32 name length, int32 type id, 8 bytes value, name bytes
+ * The value of a string is its byte length, and its bytes follow the name (version 2).
+ * The value of an array is its length, and its int32 element type and elements follow.
+ */
+
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "variable.hpp"
+
+namespace CS {
+    namespace Snapshot {
+        using std::string;
+        typedef std::unordered_map<string, Variable> Context;
+
+        const char kMagic[8] = { 'C', 'S', 'S', 'N', 'A', 'P', 0, 0 };
+        const uint32_t kVersion = 2;
+
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t count;
+        };
+
+        struct Record {
+            uint32_t length;
+            int32_t type_id;
+            Value value;
+        };
+
+        static bool Save(const Context& context, const char* file_path) {
+            FILE* output = fopen(file_path, "wb");
+            if (output == nullptr) return false;
+
+            Header header;
+            memcpy(header.magic, kMagic, sizeof(kMagic));
+            header.version = kVersion;
+            header.count = context.size();
+            bool ok = fwrite(&header, sizeof(header), 1, output) == 1;
+
+            for (auto& i: context) {
+                if (!ok) break;
+                Record record;
+                record.length = i.first.size();
+                record.type_id = i.second.type_id;
+                /* the widest member, so no byte of the union is left as it was */
+                record.value.s = 0;
+                string text;
+                /* an address means nothing to another process */
+                if (i.second.type_id == GetId("string")) {
+                    text = Strings::Str(i.second.v.s);
+                    record.value.s = text.size();
+                } else if (i.second.type_id == GetId("array")) {
+                    const GC::Array* array = static_cast<const GC::Array*>(i.second.v.p);
+                    record.value.s = array->length;
+                    text.assign(reinterpret_cast<const char*>(&array->type_id), sizeof(int32_t));
+                    text.append(reinterpret_cast<const char*>(array->data),
+                            array->length * sizeof(GC::Element));
+                } else if (i.second.type_id != GetId("pointer")) {
+                    record.value = i.second.v;
+                }
+                ok = fwrite(&record, sizeof(record), 1, output) == 1 &&
+                    fwrite(i.first.data(), 1, i.first.size(), output) == i.first.size() &&
+                    fwrite(text.data(), 1, text.size(), output) == text.size();
+            }
+            return fclose(output) == 0 && ok;
+        }
+
+        /*
+         * The variables in the file are added to 'context', nothing is changed on error.
+         * Arrays are allocated on 'heap', a file with arrays needs one.
+         */
+        static bool Restore(Context& context, const char* file_path, GC::Heap* heap = nullptr) {
+            int fd = open(file_path, O_RDONLY);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header))) {
+                close(fd);
+                return false;
+            }
+            size_t size = st.st_size;
+            void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (map == MAP_FAILED) return false;
+
+            const char* base = static_cast<const char*>(map);
+            const char* end = base + size;
+            Header header;
+            memcpy(&header, base, sizeof(header));
+            /* version 1 has no strings, and reads the same */
+            bool ok = memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+                (header.version == 1 || header.version == kVersion);
+
+            Context restored;
+            const char* cursor = base + sizeof(header);
+            for (uint32_t i = 0; ok && i < header.count; i++) {
+                Record record;
+                ok = static_cast<size_t>(end - cursor) >= sizeof(record);
+                if (!ok) break;
+                memcpy(&record, cursor, sizeof(record));
+                cursor += sizeof(record);
+                ok = static_cast<size_t>(end - cursor) >= record.length;
+                if (!ok) break;
+                string name(cursor, record.length);
+                cursor += record.length;
+                if (record.type_id == GetId("string")) {
+                    ok = static_cast<uint64_t>(end - cursor) >= record.value.s;
+                    if (!ok) break;
+                    restored[name] = Variable::String(Strings::Make(cursor, record.value.s));
+                    cursor += record.value.s;
+                } else if (record.type_id == GetId("array")) {
+                    int32_t type_id;
+                    ok = heap && static_cast<uint64_t>(end - cursor) >= sizeof(type_id) &&
+                        (static_cast<uint64_t>(end - cursor) - sizeof(type_id)) / sizeof(GC::Element) >=
+                        record.value.s;
+                    if (!ok) break;
+                    memcpy(&type_id, cursor, sizeof(type_id));
+                    cursor += sizeof(type_id);
+                    ok = type_id == GetId("int") || type_id == GetId("double");
+                    if (!ok) break;
+                    GC::Array* array = heap->Allocate(type_id, record.value.s);
+                    memcpy(array->data, cursor, record.value.s * sizeof(GC::Element));
+                    cursor += record.value.s * sizeof(GC::Element);
+                    restored[name] = Variable(array);
+                } else {
+                    restored[name] = Variable(record.value, record.type_id);
+                }
+            }
+            munmap(map, size);
+
+            if (!ok) return false;
+            for (auto& i: restored)
+                context[i.first] = i.second;
+            return true;
+        }
+    }
+}
+#endif
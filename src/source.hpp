@@ -0,0 +1,78 @@
+/**
+ * Map byte offsets back to lines and columns of the source.
+ * The start of every line is found once per source buffer, then a lookup is a binary search,
+ * so tokens and instructions only carry an int and nothing is paid until a position is printed.
+ */
+
+#ifndef SOURCE_HPP
+#define SOURCE_HPP
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "diagnostic.hpp"
+#include "opcode.hpp"
+
+namespace CS {
+    using std::string;
+
+    struct Location {
+        int line;   // from 1
+        int column; // from 1
+    };
+
+    class SourceMap {
+        public:
+            SourceMap(const string& source) {
+                Index(source.data(), source.size());
+            }
+
+            SourceMap(const char* source) {
+                Index(source, strlen(source));
+            }
+
+            /* an unknown offset is line 0 */
+            Location Locate(int offset) const {
+                Location location = { 0, 0 };
+                if (offset < 0) return location;
+                auto line = std::upper_bound(line_starts_.begin(), line_starts_.end(), offset);
+                location.line = line - line_starts_.begin();
+                location.column = offset - *(line - 1) + 1;
+                return location;
+            }
+
+            /* line:column: message */
+            string Format(const Diagnostic& diagnostic) const {
+                Location location = Locate(diagnostic.offset);
+                if (location.line == 0) return diagnostic.message;
+                return std::to_string(location.line) + ":" +
+                    std::to_string(location.column) + ": " + diagnostic.message;
+            }
+
+            int Lines() const {
+                return line_starts_.size();
+            }
+
+        private:
+            void Index(const char* source, size_t size) {
+                line_starts_.push_back(0);
+                for (size_t i = 0; i < size; i++) {
+                    if (source[i] == '\n')
+                        line_starts_.push_back(i + 1);
+                }
+            }
+
+            std::vector<int> line_starts_;
+    };
+
+    /* source offset of the statement an instruction belongs to, -1 if unknown */
+    inline int SourceOffset(const OpCode::SourceTable& sources, int pc) {
+        auto entry = std::upper_bound(sources.begin(), sources.end(),
+                std::make_pair(pc, INT_MAX));
+        if (entry == sources.begin()) return -1;
+        return (entry - 1)->second;
+    }
+}
+#endif
@@ -0,0 +1,173 @@
+/**
+ * String values in the 8 bytes of a Value.
+ * Up to 7 characters are kept in the handle itself, tagged by its lowest bit,
+ * longer strings are interned in a refcounted heap, so two handles are equal
+ * exactly when the strings are, and comparing them is one integer compare.
+ */
+
+#ifndef STRINGS_HPP
+#define STRINGS_HPP
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+
+#include "pool.hpp"
+
+namespace CS {
+    namespace Strings {
+        using std::string;
+
+        typedef uint64_t Handle;
+
+        const size_t kInline = 7;
+
+        struct Entry {
+            std::atomic<long> refs;
+            size_t hash;
+            size_t size;
+            char data[1]; // 'size' bytes in fact
+        };
+
+        /* FNV-1a */
+        static size_t Hash(const char* data, size_t size) {
+            uint64_t hash = 14695981039346656037ULL;
+            for (size_t i = 0; i < size; i++) {
+                hash ^= static_cast<unsigned char>(data[i]);
+                hash *= 1099511628211ULL;
+            }
+            return hash;
+        }
+
+        /* the entries alive, shared by every thread */
+        class Heap {
+            public:
+                static Heap& Instance() {
+                    static Heap heap;
+                    return heap;
+                }
+
+                Entry* Intern(const char* data, size_t size) {
+                    size_t hash = Hash(data, size);
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    auto range = table_.equal_range(hash);
+                    for (auto i = range.first; i != range.second; ++i) {
+                        Entry* entry = i->second;
+                        if (entry->size != size || memcmp(entry->data, data, size) != 0)
+                            continue;
+                        /* an entry down to 0 is being freed and never comes back */
+                        long refs = entry->refs.load();
+                        while (refs > 0 && !entry->refs.compare_exchange_weak(refs, refs + 1))
+                            ;
+                        if (refs > 0)
+                            return entry;
+                    }
+                    void* memory = Pool::Allocate(offsetof(Entry, data) + size);
+                    Entry* entry = new (memory) Entry;
+                    entry->refs = 1;
+                    entry->hash = hash;
+                    entry->size = size;
+                    memcpy(entry->data, data, size);
+                    table_.emplace(hash, entry);
+                    return entry;
+                }
+
+                /* only the thread taking the count to 0 frees the entry */
+                void Release(Entry* entry) {
+                    if (entry->refs.fetch_sub(1) != 1)
+                        return;
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    auto range = table_.equal_range(entry->hash);
+                    for (auto i = range.first; i != range.second; ++i) {
+                        if (i->second == entry) {
+                            table_.erase(i);
+                            break;
+                        }
+                    }
+                    size_t size = offsetof(Entry, data) + entry->size;
+                    entry->~Entry();
+                    Pool::Free(entry, size);
+                }
+
+                size_t Size() {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    return table_.size();
+                }
+
+            private:
+                Heap() {}
+
+                std::mutex mutex_;
+                std::unordered_multimap<size_t, Entry*> table_; // hash -> entries
+        };
+
+        inline bool IsInline(Handle handle) {
+            return handle & 1;
+        }
+
+        inline Entry* ToEntry(Handle handle) {
+            return reinterpret_cast<Entry*>(static_cast<uintptr_t>(handle));
+        }
+
+        /* a new reference, to be released */
+        static Handle Make(const char* data, size_t size) {
+            if (size <= kInline) {
+                Handle handle = (size << 1) | 1;
+                for (size_t i = 0; i < size; i++)
+                    handle |= static_cast<Handle>(static_cast<unsigned char>(data[i])) << (8 * (i + 1));
+                return handle;
+            }
+            return reinterpret_cast<uintptr_t>(Heap::Instance().Intern(data, size));
+        }
+
+        static Handle Make(const string& text) {
+            return Make(text.data(), text.size());
+        }
+
+        static Handle Retain(Handle handle) {
+            if (!IsInline(handle))
+                ++ToEntry(handle)->refs;
+            return handle;
+        }
+
+        static void Release(Handle handle) {
+            if (!IsInline(handle))
+                Heap::Instance().Release(ToEntry(handle));
+        }
+
+        static size_t Size(Handle handle) {
+            if (IsInline(handle))
+                return (handle & 0xff) >> 1;
+            return ToEntry(handle)->size;
+        }
+
+        /* copy the characters to 'out', which has room for Size(handle) */
+        static void Copy(Handle handle, char* out) {
+            if (IsInline(handle)) {
+                for (size_t i = 0; i < Size(handle); i++)
+                    out[i] = static_cast<char>(handle >> (8 * (i + 1)));
+            } else {
+                memcpy(out, ToEntry(handle)->data, ToEntry(handle)->size);
+            }
+        }
+
+        static string Str(Handle handle) {
+            string text(Size(handle), '\0');
+            Copy(handle, &text[0]);
+            return text;
+        }
+
+        static Handle Concat(Handle lhs, Handle rhs) {
+            size_t size = Size(lhs);
+            string text(size + Size(rhs), '\0');
+            Copy(lhs, &text[0]);
+            Copy(rhs, &text[size]);
+            return Make(text);
+        }
+    }
+}
+#endif
@@ -9,7 +9,17 @@
 #include "opcode.hpp"
 #include "encoder.hpp"
 #include "serializer.hpp"
+#include "verifier.hpp"
 #include "vm.hpp"
+#include "bytecode.hpp"
+#include "compress.hpp"
+#include "archive.hpp"
+#include "cache.hpp"
+#include "session.hpp"
+#include "compiler.hpp"
+#include "source.hpp"
+#include "trace.hpp"
+#include "scheduler.hpp"
 
 
 using namespace CS;
@@ -19,6 +29,14 @@ const char* GetSourceCode() {
     return code;
 }
 
+/* evaluate 'line' and check what it shows, the line runs even when asserts do not */
+template <typename Repl>
+void Check(Repl& repl, const char* line, const std::string& expected) {
+    std::string result = repl.Evaluate(line);
+    assert(result == expected);
+    (void)result;
+}
+
 void TestScanner() {
     printf("------scanner test------\n");
     const char* code = GetSourceCode();
@@ -54,6 +72,26 @@ void TestParser() {
     CS::Parser parser;
     std::shared_ptr<SyntaxTree> syntax_tree(parser.Parse(token_list));
     DumpSyntaxTree(syntax_tree.get(), 0);
+
+    /* priority, parentheses and unary minus */
+    CS::TokenList expr_tokens = CS::Scanner::Scan("a = (1 + 2) * -3 - -a / 2;\n");
+    std::shared_ptr<SyntaxTree> expr(parser.Parse(expr_tokens));
+    DumpSyntaxTree(expr.get(), 0);
+    SyntaxTree* sub = expr->right_;
+    assert(sub->value_ == "-");
+    assert(sub->left_->value_ == "*");
+    assert(sub->left_->left_->value_ == "+");
+    assert(sub->left_->right_->value_ == "-3");
+    assert(sub->right_->value_ == "/");
+    assert(sub->right_->left_->value_ == "-");
+    assert(sub->right_->left_->left_ == nullptr);
+    assert(sub->right_->left_->right_->value_ == "a");
+
+    /* left associative */
+    CS::TokenList assoc_tokens = CS::Scanner::Scan("8 - 4 - 2;\n");
+    std::shared_ptr<SyntaxTree> assoc(parser.Parse(assoc_tokens));
+    assert(assoc->left_->value_ == "-");
+    assert(assoc->right_->value_ == "2");
     printf("-----pass: parser test------\n\n");
 }
 
@@ -79,9 +117,430 @@ void TestEvaluator() {
     std::cout << eval.Evaluate("int a;\n") << std::endl;
     std::cout << eval.Evaluate("a = 1+1;\n") << std::endl;
     std::cout << eval.Evaluate("println(a);\n") << std::endl;
+    Check(eval, "a = (1 + 2) * -3 - 4;\n", "a = -13");
+    Check(eval, "a = -(a + 3) * 2;\n", "a = 20");
+    /* a read does not make the variable */
+    Check(eval, "x = q + 1;\n", "");
+    Check(eval, "x = q;\n", "");
+    Check(eval, "q = 2;\n", "q = 2");
+    Check(eval, "x = q + 1;\n", "x = 3");
     printf("-----pass: evaluator test------\n\n");
 }
 
+void TestEvaluation() {
+    printf("-----evaluation test------\n");
+    std::string out;
+    CS::Format::AppendInt(out, -9223372036854775807LL - 1);
+    assert(out == "-9223372036854775808");
+    out.clear();
+    CS::Format::AppendShortest(out, 0.1);
+    out += ' ';
+    CS::Format::AppendShortest(out, 1.0 / 3);
+    out += ' ';
+    CS::Format::AppendShortest(out, 8.0);
+    out += ' ';
+    CS::Format::AppendShortest(out, -0.0);
+    assert(out == "0.1 0.3333333333333333 8.0 -0.0");
+    assert(strtod("0.3333333333333333", nullptr) == 1.0 / 3);
+
+    /* what was done, with the values as they are */
+    CS::Evaluator eval;
+    const CS::Evaluation& declared = eval.Run("double d;\n");
+    assert(declared.Size() == 1 && declared.At(0).id == "d" && declared.At(0).declared);
+    assert(declared.Text() == "d = 0.0");
+    const CS::Evaluation& block = eval.Run("{ d = 0.1 * 3; int[2] a; a[1] = 2; sum(a); }\n");
+    assert(block.Size() == 4);
+    assert(block.Value(0).type_id == GetId("double") && block.Value(0).v.d == 0.1 * 3);
+    assert(block.At(2).id == "a" && block.At(2).index == 1 && block.Value(2).v.i == 2);
+    assert(block.At(3).id.empty() && block.Value(3).v.i == 2);
+    /* an array is held, not copied, so it shows its elements as they are at the end */
+    assert(block.Text() == "d = 0.300000\na = [0, 2]\na[1] = 2\n2");
+    assert(block.Text(CS::Format::kShortest) == "d = 0.30000000000000004\na = [0, 2]\na[1] = 2\n2");
+    /* a call giving nothing shows nothing */
+    const CS::Evaluation& nothing = eval.Run("println();\n");
+    assert(nothing.Text().empty());
+    Check(eval, "d = 1.5;\n", "d = 1.500000");
+    printf("-----pass: evaluation test------\n\n");
+}
+
+void TestSharedExpression() {
+    printf("-----shared expression test------\n");
+    /* equal subtrees are one node, in a line and across lines */
+    CS::Parser parser(true);
+    CS::TokenList tokens = CS::Scanner::Scan("a = (b * c) + (b * c);\n");
+    std::shared_ptr<SyntaxTree> tree(parser.Parse(tokens));
+    assert(tree->right_->left_ == tree->right_->right_);
+    assert(tree->right_->left_->inputs_.size() == 2);
+    CS::TokenList again_tokens = CS::Scanner::Scan("d = b * c - -1;\n");
+    std::shared_ptr<SyntaxTree> again(parser.Parse(again_tokens));
+    assert(again->right_->left_ == tree->right_->left_);
+    /* a call is never shared, so it is called each time */
+    CS::TokenList call_tokens = CS::Scanner::Scan("f(b * c, b * c);\n");
+    std::shared_ptr<SyntaxTree> call(parser.Parse(call_tokens));
+    assert(!call->shared_);
+    assert(call->right_ != call->right_->next_);
+    assert(call->right_->left_ == tree->right_->left_->left_);
+    tree.reset();
+    again.reset();
+    call.reset();
+
+    CS::Evaluator eval;
+    eval.Evaluate("int b;\n");
+    eval.Evaluate("int c;\n");
+    eval.Evaluate("b = 3;\n");
+    eval.Evaluate("c = 4;\n");
+    Check(eval, "a = (b * c) + (b * c);\n", "a = 24");
+    assert(eval.Reused() == 1);
+    /* nothing read by the expression changed since */
+    Check(eval, "a = (b * c) + (b * c);\n", "a = 24");
+    assert(eval.Reused() == 2);
+    Check(eval, "d = a + b * c;\n", "d = 36");
+    assert(eval.Reused() == 3);
+    eval.Evaluate("b = 5;\n");
+    Check(eval, "a = (b * c) + (b * c);\n", "a = 40");
+    assert(eval.Reused() == 4);
+    Check(eval, "a = a + 1;\n", "a = 41");
+    Check(eval, "a = a + 1;\n", "a = 42");
+    printf("-----pass: shared expression test------\n\n");
+}
+
+void TestReactive() {
+    printf("-----reactive test------\n");
+    CS::Evaluator sheet(true);
+    sheet.Evaluate("int b;\n");
+    Check(sheet, "b = 2;\n", "b = 2");
+    Check(sheet, "c = 3;\n", "c = 3");
+    Check(sheet, "a = b * c;\n", "a = 6");
+    Check(sheet, "d = a + 1;\n", "d = 7");
+    Check(sheet, "e = c - a;\n", "e = -3");
+    /* only what depends on the input, each after what it reads */
+    Check(sheet, "b = 5;\n", "b = 5\na = 15\ne = -12\nd = 16");
+    Check(sheet, "d = 0;\n", "d = 0");
+    Check(sheet, "c = 1;\n", "c = 1\na = 5\ne = -4");
+    /* a cycle is refused and changes nothing */
+    Check(sheet, "b = e + 1;\n", "");
+    Check(sheet, "c = 2;\n", "c = 2\na = 10\ne = -8");
+    /* a declaration drops the formula */
+    Check(sheet, "int a;\n", "a = 0\ne = 2");
+    Check(sheet, "b = 1;\n", "b = 1");
+    printf("-----pass: reactive test------\n\n");
+}
+
+void TestScope() {
+    printf("-----scope test------\n");
+    CS::Evaluator eval;
+    eval.Evaluate("int a;\n");
+    eval.Evaluate("a = 1;\n");
+    Check(eval, "{ int a; a = 2; { int b; b = a * 10; a = b + a; } c = a; }\n",
+            "a = 0\na = 2\nb = 0\nb = 20\na = 22\nc = 22");
+    /* the inner 'a' is gone, the global written inside stays */
+    Check(eval, "a = a;\n", "a = 1");
+    Check(eval, "c = c;\n", "c = 22");
+    /* shadowing and a redeclaration in the same scope */
+    Check(eval, "{ a = a + 1; int a; a = 5; { int a; a = 7; } a = a + 1; }\n",
+            "a = 2\na = 0\na = 5\na = 0\na = 7\na = 6");
+    Check(eval, "a = a;\n", "a = 2");
+
+    /* a block never needs ';', an unclosed one is an error */
+    CS::Parser parser;
+    CS::Diagnostics diagnostics;
+    CS::TokenList tokens = CS::Scanner::Scan("{ int a; a = ; b = 1; }\n{ int c;", &diagnostics);
+    std::shared_ptr<SyntaxTree> tree(parser.Parse(tokens, &diagnostics));
+    assert(diagnostics.size() == 2);
+    assert(diagnostics[0].message == "not a value: ';'");
+    assert(diagnostics[1].message == "expected '}'");
+    assert(tree->value_ == "{" && tree->next_ == nullptr);
+    assert(tree->left_->next_->value_ == "=");
+    printf("-----pass: scope test------\n\n");
+}
+
+void TestString() {
+    printf("-----string test------\n");
+    using namespace CS::Strings;
+    size_t entries = Heap::Instance().Size();
+    {
+        /* short strings live in the handle, long ones are interned */
+        Handle small = Make("short");
+        assert(IsInline(small) && Size(small) == 5 && Str(small) == "short");
+        Handle large = Make("longer than seven");
+        Handle same = Make(string("longer ") + "than seven");
+        assert(!IsInline(large) && large == same);
+        assert(Heap::Instance().Size() == entries + 1);
+        Handle tail = Make(" and longer");
+        Handle joined = Concat(small, tail);
+        assert(Str(joined) == "short and longer");
+        Release(tail);
+        Release(large);
+        Release(same);
+        Release(joined);
+        assert(Heap::Instance().Size() == entries);
+    }
+
+    CS::TokenList tokens = CS::Scanner::Scan("s = \"a \\\"quoted\\\" word\";\n");
+    assert(tokens.size() == 4 && tokens[2].first == "a \"quoted\" word");
+    CS::Diagnostics diagnostics;
+    CS::Scanner::Scan("s = \"open;\n", &diagnostics);
+    assert(diagnostics.size() == 1 && diagnostics[0].message == "unterminated string");
+
+    {
+        CS::Evaluator eval;
+        Check(eval, "string s;\n", "s = ");
+        Check(eval, "s = \"hello\" + \", \" + \"world\";\n", "s = hello, world");
+        Check(eval, "n = len(s) * 2;\n", "n = 24");
+        Check(eval, "t = concat(\"hello, \", \"world\");\n", "t = hello, world");
+        Check(eval, "e = s == t;\n", "e = 1");
+        Check(eval, "e = s != \"hello\";\n", "e = 1");
+        Check(eval, "e = 1 + 1 == 2;\n", "e = 1");
+        Check(eval, "println(s, n);\n", "");
+        /* an invalid operation is reported, and the statement writes nothing */
+        Check(eval, "n = s - 1;\n", "");
+        Check(eval, "n = (s + 1) * 2 + n;\n", "");
+        Check(eval, "e = n;\n", "e = 24");
+        Check(eval, "s = \"\";\n", "s = ");
+        Check(eval, "t = \"\";\n", "t = ");
+    }
+    /* nothing is left once the values are gone */
+    assert(Heap::Instance().Size() == entries);
+    printf("-----pass: string test------\n\n");
+}
+
+void TestArray() {
+    printf("-----array test------\n");
+    {
+        /* survivors leave the nursery, the rest is dropped */
+        CS::GC::Heap heap(4096);
+        CS::GC::Array* kept = heap.Allocate(1, 10);
+        kept->data[3].i = 42;
+        CS::GC::Array* dropped = heap.Allocate(2, 100);
+        assert(heap.InNursery(kept) && heap.InNursery(dropped));
+        CS::GC::Array* alias = kept;
+        std::vector<CS::GC::Array**> roots = { &kept, &alias };
+        heap.Collect(roots);
+        assert(!heap.InNursery(kept) && kept->data[3].i == 42 && kept->length == 10);
+        assert(alias == kept);
+        assert(heap.Statistics().minor == 1);
+        assert(heap.Statistics().promoted == CS::GC::Array::Bytes(10));
+        /* an array too large for the nursery goes to the old generation */
+        CS::GC::Array* large = heap.Allocate(1, 1000);
+        assert(!heap.InNursery(large));
+        roots.push_back(&large);
+        heap.Collect(roots, true);
+        assert(heap.Statistics().major == 1);
+        assert(kept->data[3].i == 42 && alias == kept && large->length == 1000);
+        assert(heap.Statistics().live == CS::GC::Array::Bytes(10) + CS::GC::Array::Bytes(1000));
+    }
+
+    CS::Evaluator eval;
+    Check(eval, "int[3] a;\n", "a = [0, 0, 0]");
+    Check(eval, "a[1] = 5;\n", "a[1] = 5");
+    Check(eval, "b = a[1] * 2;\n", "b = 10");
+    Check(eval, "a[a[0] + 1] = 7.5;\n", "a[1] = 7");
+    Check(eval, "b = a[1] * 2;\n", "b = 14");
+    Check(eval, "n = len(a);\n", "n = 3");
+    Check(eval, "double[n - 1] d;\n", "d = [0.000000, 0.000000]");
+    Check(eval, "d[0] = 1.5;\n", "d[0] = 1.500000");
+    Check(eval, "a[3] = 1;\n", "");
+    Check(eval, "n[0] = 1;\n", "");
+    /* an element out of range is no value, so the assignment leaves 'b' as it was */
+    Check(eval, "b = a[3];\n", "");
+    Check(eval, "c = b;\n", "c = 14");
+    Check(eval, "b = a[1] + a;\n", "");
+    Check(eval, "a[0] = a * 2;\n", "");
+    /* an array is equal to itself only */
+    Check(eval, "e = a == a;\n", "e = 1");
+    Check(eval, "e = a == d;\n", "e = 0");
+    Check(eval, "e = a != n;\n", "e = 1");
+    /* the slots after an array which failed are where the block expects them */
+    Check(eval, "{ int[-1] e; int f; f = 1; }\n", "f = 0\nf = 1");
+    /* so are those after an array the heap refuses to hold */
+    Check(eval, "{ int[2000000000] e; int f; f = 1; }\n", "f = 0\nf = 1");
+    /* short-lived arrays are collected between statements, live ones move */
+    for (int i = 0; i < 200; i++)
+        eval.Evaluate("{ int[1000] t; t[999] = 1; }\n");
+    assert(eval.Collector().minor > 0);
+    eval.Collect();
+    assert(eval.Collector().major == 1);
+    Check(eval, "b = a[1] + d[0];\n", "b = 8.500000");
+
+    CS::Evaluator sheet(true);
+    sheet.Evaluate("int[2] v;\n");
+    sheet.Evaluate("s = v[0] + v[1];\n");
+    Check(sheet, "v[1] = 3;\n", "v[1] = 3\ns = 3");
+    bool saved = sheet.Save("./array.snap");
+    assert(saved);
+    CS::Evaluator restored;
+    bool loaded = restored.Restore("./array.snap");
+    assert(loaded);
+    Check(restored, "s = v[1];\n", "s = 3");
+    remove("./array.snap");
+    printf("-----pass: array test------\n\n");
+}
+
+void TestSimd() {
+    printf("-----simd test------\n");
+    CS::Simd::Level best = CS::Simd::Current();
+    CS::Simd::Level levels[] = { CS::Simd::kScalar, CS::Simd::kSse2, CS::Simd::kAvx2 };
+    for (CS::Simd::Level level: levels) {
+        if (!CS::Simd::Supported(level))
+            continue;
+        CS::Simd::Current() = level;
+        /* 13 elements leave a tail after every vector width */
+        CS::Evaluator eval;
+        eval.Evaluate("int[13] a;\n");
+        eval.Evaluate("int[13] b;\n");
+        eval.Evaluate("double[13] x;\n");
+        eval.Evaluate("double[13] y;\n");
+        for (int i = 0; i < 13; i++) {
+            string at = "[" + std::to_string(i) + "] = ";
+            eval.Evaluate("a" + at + std::to_string((i * 7) % 11 - 5) + ";\n");
+            eval.Evaluate("b" + at + std::to_string(i + 1) + ";\n");
+            eval.Evaluate("x" + at + std::to_string(i) + ".5;\n");
+            eval.Evaluate("y" + at + std::to_string(13 - i) + ".25;\n");
+        }
+        Check(eval, "r = sum(a);\n", "r = -3");
+        Check(eval, "r = min(a);\n", "r = -5");
+        Check(eval, "r = max(a);\n", "r = 5");
+        Check(eval, "r = dot(a, b);\n", "r = -23");
+        Check(eval, "r = sum(x);\n", "r = 84.500000");
+        Check(eval, "r = min(y);\n", "r = 1.250000");
+        Check(eval, "r = max(x);\n", "r = 12.500000");
+        Check(eval, "r = dot(x, y);\n", "r = 430.625000");
+        Check(eval, "c = add(a, b);\n", "c = [-4, 4, 1, 9, 6, 3, 11, 8, ...]");
+        Check(eval, "r = c[12];\n", "r = 15");
+        Check(eval, "c = mul(a, b);\n", "c = [-5, 4, -6, 20, 5, -18, 28, 0, ...]");
+        Check(eval, "r = c[11];\n", "r = -60");
+        /* axpy writes y in place, behind the memo of y[12] */
+        Check(eval, "r = y[12];\n", "r = 1.250000");
+        eval.Evaluate("z = axpy(2, x, y);\n");
+        Check(eval, "r = y[12];\n", "r = 26.250000");
+        eval.Evaluate("z = axpy(-1, b, a);\n");
+        Check(eval, "r = a[12];\n", "r = -11");
+        Check(eval, "r = min(a);\n", "r = -17");
+        /* arrays of another type or length are refused, and give no value */
+        Check(eval, "r = dot(a, x);\n", "");
+        Check(eval, "r = sum(5);\n", "");
+        Check(eval, "r = len(5);\n", "");
+        eval.Evaluate("int[0] e;\n");
+        Check(eval, "r = sum(e);\n", "r = 0");
+        Check(eval, "r = max(e);\n", "");
+    }
+    CS::Simd::Current() = best;
+    printf("-----pass: simd test------\n\n");
+}
+
+void TestInlineCache() {
+    printf("-----inline cache test------\n");
+    CS::Evaluator eval;
+    eval.Evaluate("x = 1;\n");
+    Check(eval, "y = x * 2 + x;\n", "y = 3");
+    /* the names of the statement are resolved, running it again looks nothing up */
+    long lookups = eval.Lookups();
+    for (int i = 0; i < 10; i++)
+        Check(eval, "y = x * 2 + x;\n", "y = 3");
+    assert(eval.Lookups() == lookups);
+    /* a new name sends the sites back to the tables, once */
+    eval.Evaluate("z = 2;\n");
+    Check(eval, "y = x * 2 + x;\n", "y = 3");
+    lookups = eval.Lookups();
+    Check(eval, "y = x * 2 + x;\n", "y = 3");
+    assert(eval.Lookups() == lookups);
+    /* an unknown function is reported, every time, and not added */
+    Check(eval, "nothing();\n", "");
+    Check(eval, "nothing();\n", "");
+    /* and gives no value, so 'y' keeps the one it had */
+    Check(eval, "y = nothing() + 1;\n", "");
+    Check(eval, "y = y;\n", "y = 3");
+
+    /* formulas run again from their trees, so their calls stay resolved too */
+    CS::Evaluator sheet(true);
+    sheet.Evaluate("int[4] a;\n");
+    sheet.Evaluate("s = sum(a) + len(a);\n");
+    lookups = sheet.Lookups();
+    for (int i = 0; i < 10; i++)
+        sheet.Evaluate("a[0] = " + std::to_string(i) + ";\n");
+    Check(sheet, "a[1] = 10;\n", "a[1] = 10\ns = 23");
+    /* every write is a new statement, whose target is looked up once */
+    assert(sheet.Lookups() - lookups <= 11);
+    /* a site cached in one block finds the globals of another */
+    Check(eval, "s = x + 1;\n", "s = 2");
+    printf("-----pass: inline cache test------\n\n");
+}
+
+void TestPool() {
+    printf("-----pool test------\n");
+    using namespace CS;
+    Pool::Stats before = Pool::Statistics();
+    /* a freed object is the next one given out of its class */
+    void* a = Pool::Allocate(40);
+    assert(reinterpret_cast<uintptr_t>(a) % Pool::kGranule == 0);
+    Pool::Free(a, 40);
+    void* b = Pool::Allocate(33);
+    assert(a == b);
+    void* c = Pool::Allocate(48);
+    assert(c != b);
+    Pool::Free(b, 33);
+    Pool::Free(c, 48);
+    void* large = Pool::Allocate(Pool::kMaxSize + 1);
+    Pool::Free(large, Pool::kMaxSize + 1);
+    Pool::Stats after = Pool::Statistics();
+    assert(after.allocations - before.allocations == 3);
+    assert(after.frees - before.frees == 3 && after.large - before.large == 1);
+
+    /* what another thread frees and leaves behind is used by the others */
+    void* shared = Pool::Allocate(250);
+    void* left = nullptr;
+    std::thread worker([&]() {
+        Pool::Free(shared, 250);
+        left = Pool::Allocate(250);
+        assert(left == shared);
+        Pool::Free(left, 250);
+    });
+    worker.join();
+    void* reused = Pool::Allocate(250);
+    assert(reused == left);
+    Pool::Free(reused, 250);
+
+    /* the nodes of the parser and the arguments of a call come from the pool */
+    before = Pool::Statistics();
+    {
+        CS::Evaluator eval;
+        Check(eval, "a = len(\"a longer string\") + 1;\n", "a = 16");
+    }
+    after = Pool::Statistics();
+    assert(after.allocations - before.allocations > 5);
+    assert(after.allocations - after.frees == before.allocations - before.frees);
+    printf("-----pass: pool test------\n\n");
+}
+
+void TestSnapshot() {
+    printf("-----snapshot test------\n");
+    CS::Evaluator eval;
+    eval.Evaluate("int a;\n");
+    eval.Evaluate("a = 1+1;\n");
+    eval.Evaluate("double b;\n");
+    eval.Evaluate("s = \"a string longer than seven bytes\";\n");
+    bool saved = eval.Save("./test.snap");
+    assert(saved);
+
+    CS::Evaluator restored;
+    bool loaded = restored.Restore("./test.snap");
+    assert(loaded);
+    std::cout << restored.Evaluate("a = a;\n") << std::endl;
+    Check(restored, "s = s;\n", "s = a string longer than seven bytes");
+    remove("./test.snap");
+
+    /* a truncated file changes nothing */
+    FILE* file = fopen("./bad.snap", "wb");
+    fwrite("CSSNAP", 1, 6, file);
+    fclose(file);
+    loaded = restored.Restore("./bad.snap");
+    assert(!loaded);
+    loaded = restored.Restore("./missing.snap");
+    assert(!loaded);
+    remove("./bad.snap");
+    printf("-----pass: snapshot test------\n\n");
+}
+
 void TestOpCode() {
     printf("-----opcode test------\n");
     using namespace CS::OpCode;
@@ -166,8 +625,8 @@ void TestSerializer() {
     
     /* deserialize */
     auto deserialized = Serializer::Deserialize("./test.oc");
-    auto inst_d = deserialized.first;
-    auto symb_d = deserialized.second;
+    std::unique_ptr<InstructionTable> inst_d(deserialized.first);
+    std::unique_ptr<SymbolTable> symb_d(deserialized.second);
 
     assert(*inst == *inst_d);
     assert(*symb == *symb_d);
@@ -175,6 +634,74 @@ void TestSerializer() {
     printf("-----pass: serializer test-----\n\n");
 }
 
+void TestVerifier() {
+    printf("-----verifier test-----\n");
+    using namespace CS;
+    using namespace OpCode;
+
+    Parser parser;
+    Encoder::Encoder encoder;
+    const char* code = GetSourceCode();
+
+    TokenList token_list = Scanner::Scan(code);
+    std::shared_ptr<SyntaxTree> syntax_tree(parser.Parse(token_list));
+    auto instruction_symbol = encoder.Encode(syntax_tree.get());
+
+    /* alloc a; push 1; push 1 -> 3 slots at most, 'a' is left */
+    Verifier::StackInfo info = Verifier::AnalyzeStack(*instruction_symbol.first);
+    assert(info.ok);
+    assert(info.max_depth == 3);
+    assert(info.exit_depth == 1);
+
+    /* pop from an empty stack */
+    InstructionTable underflow = { MakeOpCode("pop", 0) };
+    assert(!Verifier::AnalyzeStack(underflow).ok);
+
+    /* an operand is left on the stack */
+    InstructionTable unbalanced = { MakeOpCode("push", 1) };
+    assert(!Verifier::AnalyzeStack(unbalanced).ok);
+
+    /* the existing slots could be addressed */
+    InstructionTable reuse = { MakeOpCode("load", 0), MakeOpCode("pop", 0) };
+    assert(!Verifier::AnalyzeStack(reuse).ok);
+    assert(Verifier::AnalyzeStack(reuse, 1).ok);
+    assert(Verifier::AnalyzeStack(reuse, 1).max_depth == 2);
+
+    /* programs from untrusted files */
+    FunctionTable builtins;
+    Function::RegisterFunctions(builtins);
+    SymbolTable symbols = { { "println", 1 } };
+    assert(Verifier::Verify(*instruction_symbol.first, symbols, builtins).ok);
+
+    InstructionTable bad_opcode = { MakeOpCode(99, 0) };
+    assert(!Verifier::Verify(bad_opcode, symbols, builtins).ok);
+    InstructionTable bad_call = { MakeOpCode("call", 2) };
+    assert(!Verifier::Verify(bad_call, symbols, builtins).ok);
+    InstructionTable bad_jump = { MakeOpCode("jmp", 5) };
+    assert(!Verifier::Verify(bad_jump, symbols, builtins).ok);
+    InstructionTable bad_alloc = { MakeOpCode("alloc", 3) };
+    assert(!Verifier::Verify(bad_alloc, symbols, builtins).ok);
+    InstructionTable skip = { MakeOpCode("jmp", 1), MakeOpCode("pop", 0) };
+    assert(Verifier::Verify(skip, symbols, builtins).ok);
+    SymbolTable bad_symbols = { { "system", 1 } };
+    assert(!Verifier::Verify(skip, bad_symbols, builtins).ok);
+
+    /* a malformed file is refused by the deserializer */
+    FILE* file = fopen("./bad.oc", "w");
+    fprintf(file, "1000000 1000000\nprintln 1\n");
+    fclose(file);
+    auto refused = Serializer::Deserialize("./bad.oc");
+    assert(refused.first == nullptr && refused.second == nullptr);
+    remove("./bad.oc");
+
+    /* and bad code by the vm */
+    VM::VM vm;
+    bool ran = vm.Execute(bad_call);
+    assert(!ran && vm.Depth() == 0);
+
+    printf("-----pass: verifier test-----\n\n");
+}
+
 void TestVM() {
     printf("-----vm test-----\n");
     using namespace CS;
@@ -193,21 +720,762 @@ void TestVM() {
 
     vm.LoadSymbolTable(*symb);
     vm.Execute(*inst);
+    assert(vm.Depth() == 1);
 
     printf("-----pass: vm test-----\n\n");
 }
 
+/* set by the test, read by the waiter of the vm */
+struct Mailbox {
+    std::atomic<bool> ready;
+};
+
+bool Ready(CS::VM::VM& vm) {
+    return static_cast<Mailbox*>(vm.UserData())->ready.load();
+}
+
+/* a vm with 'code' loaded and 'ready' as a waiter */
+std::unique_ptr<CS::VM::VM> LoadVM(const char* code, Mailbox* box = nullptr) {
+    Result<CS::Compiler::Program> program = CS::Compiler::Compile(code);
+    assert(program.Ok());
+    std::unique_ptr<CS::VM::VM> vm(new CS::VM::VM());
+    vm->Register("ready", Ready);
+    vm->SetUserData(box);
+    bool loaded = vm->Load(program.value.instructions, program.value.symbols);
+    assert(loaded);
+    (void)loaded;
+    return vm;
+}
+
+void TestScheduler() {
+    printf("-----scheduler test-----\n");
+    using namespace CS;
+
+    /* a budget splits the run, not what it does */
+    std::string code = "int a;\n";
+    for (int i = 0; i < 20; i++)
+        code += "a = a + " + std::to_string(i) + ";\n";
+    std::unique_ptr<VM::VM> whole = LoadVM(code.c_str());
+    VM::Status status = whole->Resume(1 << 30);
+    assert(status == VM::kDone);
+    std::unique_ptr<VM::VM> sliced = LoadVM(code.c_str());
+    int slices = 1;
+    while (sliced->Resume(5) == VM::kPreempted)
+        ++slices;
+    assert(slices > 10 && sliced->Done());
+    assert(sliced->Slot(0) == whole->Slot(0) && whole->Slot(0) == 190);
+
+    /* a waiter which is not ready stops the vm on its call */
+    const char* waiting = "int a;\na = 1;\nready();\na = a + 41;\n";
+    Mailbox box;
+    box.ready = false;
+    std::unique_ptr<VM::VM> vm = LoadVM(waiting, &box);
+    status = vm->Resume(1000);
+    assert(status == VM::kBlocked);
+    status = vm->Resume(1000);
+    assert(status == VM::kBlocked && vm->Slot(0) == 1);
+    box.ready = true;
+    status = vm->Resume(1000);
+    assert(status == VM::kDone && vm->Slot(0) == 42);
+
+    /* a block loaded behind one which has not run yet starts where that one ends */
+    Parser parser;
+    Encoder::Encoder encoder;
+    VM::VM queued;
+    const char* blocks[] = {"int a; int b; a = 1;", "int c; int d; c = a + 2; d = c * 2;"};
+    for (const char* block: blocks) {
+        TokenList token_list = Scanner::Scan(block);
+        std::shared_ptr<SyntaxTree> tree(parser.Parse(token_list));
+        OpCode::InstructionTable instructions = encoder.Append(tree.get());
+        bool loaded = queued.Load(instructions, encoder.Symbols());
+        assert(loaded);
+    }
+    status = queued.Resume(1000);
+    assert(status == VM::kDone && queued.Depth() == 4);
+    assert(queued.Slot(encoder.Slot("c")) == 3 && queued.Slot(encoder.Slot("d")) == 6);
+
+    /* many vms on two threads, each parked until its mailbox is filled */
+    const int tasks = 64;
+    std::vector<Mailbox> boxes(tasks);
+    VM::Scheduler scheduler(2, 3);
+    for (int i = 0; i < tasks; i++) {
+        boxes[i].ready = false;
+        int id = scheduler.Spawn(LoadVM(waiting, &boxes[i]));
+        assert(id == i);
+    }
+    for (int i = tasks - 1; i >= 0; i--) {
+        boxes[i].ready = true;
+        scheduler.Wake(i);
+    }
+    scheduler.Wait();
+    for (int i = 0; i < tasks; i++)
+        assert(scheduler.Done(i) && scheduler.Get(i).Slot(0) == 42);
+    /* each was preempted at least once on the way */
+    assert(scheduler.Resumes() >= 2 * tasks);
+    printf("-----pass: scheduler test-----\n\n");
+}
+
+void TestImage() {
+    printf("-----image test-----\n");
+    using namespace CS;
+
+    /* one copy of the code, run by every vm */
+    Result<Compiler::Program> one = Compiler::Compile("int a;\na = 1;\na = a + 1;\n");
+    VM::ImagePtr image = VM::Image::Make(one.value.instructions, one.value.symbols);
+    assert(image && image->max_depth > 0);
+    VM::VM first, second;
+    bool ran = first.Execute(image);
+    assert(ran);
+    ran = second.Execute(image);
+    assert(ran);
+    assert(first.Shared() == image && second.Shared() == image && image.use_count() == 3);
+    assert(first.Slot(0) == 2 && second.Slot(0) == 2);
+    /* loading again starts over */
+    ran = first.Execute(image);
+    assert(ran && first.Depth() == 1 && first.Slot(0) == 2);
+
+    /* code added to an image is the vm's own, the image is left as it was */
+    Encoder::Encoder encoder;
+    Parser parser;
+    TokenList tokens = Scanner::Scan("int a;\na = 1;\na = a + 1;\n");
+    std::shared_ptr<SyntaxTree> tree(parser.Parse(tokens));
+    encoder.Encode(tree.get());
+    TokenList more_tokens = Scanner::Scan("a = a * 10;\n");
+    std::shared_ptr<SyntaxTree> more(parser.Parse(more_tokens));
+    ran = first.Execute(encoder.Append(more.get()));
+    assert(ran);
+    assert(!first.Shared() && first.Slot(0) == 20);
+    assert(image->instructions == one.value.instructions);
+
+    /* checked once when made, and against the builtins of each vm */
+    OpCode::InstructionTable bad = { OpCode::MakeOpCode("pop", 0) };
+    assert(!VM::Image::Make(bad, OpCode::SymbolTable()));
+    Result<Compiler::Program> waiting = Compiler::Compile("ready();\n");
+    assert(!VM::Image::Make(waiting.value.instructions, waiting.value.symbols));
+    std::unique_ptr<VM::VM> with = LoadVM("int a;\n");
+    VM::ImagePtr calls = VM::Image::Make(waiting.value.instructions, waiting.value.symbols,
+            with->Builtins());
+    assert(calls);
+    bool loaded = with->Load(calls);
+    assert(loaded);
+    VM::VM without;
+    loaded = without.Load(calls);
+    assert(!loaded);
+
+    /* a vm keeps the image it loaded while a new one is published */
+    Result<Compiler::Program> two = Compiler::Compile("int a;\na = 5;\na = a + 1;\n");
+    VM::ImageStore store(image);
+    VM::VM running;
+    loaded = running.Load(store.Get());
+    VM::Status status = running.Resume(3);
+    assert(loaded && status == VM::kPreempted);
+    store.Publish(VM::Image::Make(two.value.instructions, two.value.symbols));
+    image.reset();
+    status = running.Resume(100);
+    assert(status == VM::kDone && running.Slot(0) == 2);
+    assert(running.Shared() != store.Get() && running.Shared() == second.Shared());
+    ran = running.Execute(store.Get());
+    assert(ran && running.Slot(0) == 6);
+
+    /* swapped while threads load and run it */
+    std::atomic<bool> wrong(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.emplace_back([&]() {
+            VM::VM vm;
+            for (int i = 0; i < 20; i++) {
+                VM::ImagePtr now = store.Get();
+                int expected = now->instructions == one.value.instructions ? 2 : 6;
+                if (!vm.Execute(now) || vm.Slot(0) != expected)
+                    wrong = true;
+            }
+        });
+    }
+    for (int i = 0; i < 20; i++)
+        store.Publish(VM::Image::Make((i % 2 ? one : two).value.instructions,
+                    (i % 2 ? one : two).value.symbols));
+    for (auto& thread: threads)
+        thread.join();
+    assert(!wrong);
+    printf("-----pass: image test-----\n\n");
+}
+
+void TestFuse() {
+    printf("-----fuse test-----\n");
+    using namespace CS;
+    using namespace OpCode;
+
+    Result<Compiler::Program> program =
+        Compiler::Compile("int a;\na = a + 3;\na = a - 2;\na = a * 4;\n");
+    InstructionTable& table = program.value.instructions;
+    assert(table.size() == 16);
+    InstructionTable fused;
+    std::vector<int> origin;
+    Fuse(table, 0, fused, origin);
+    InstructionTable expected = {
+        MakeOpCode("alloc", 4), MakeOpCode("load", 0), MakeOpCode("addi", 3), MakeOpCode("store", 0),
+        MakeOpCode("load", 0), MakeOpCode("subi", 2), MakeOpCode("store", 0),
+        MakeOpCode("load", 0), MakeOpCode("push", 4), MakeOpCode("mul", 0), MakeOpCode("store", 0)
+    };
+    assert(fused == expected);
+    assert((origin == std::vector<int>{ 0, 1, 2, 4, 6, 7, 9, 11, 12, 13, 14 }));
+
+    /* the same run in fewer dispatches */
+    VM::VM plain, fast(true);
+    bool ran = plain.Execute(table);
+    bool ran_fast = fast.Execute(table);
+    assert(ran && ran_fast);
+    assert(plain.Slot(0) == 4 && fast.Slot(0) == 4);
+    assert(plain.Done() && fast.Done());
+
+    /* the offsets of a jump count the instructions as given */
+    InstructionTable jumps = {
+        MakeOpCode("alloc", 4), MakeOpCode("jmp", 2), MakeOpCode("push", 7), MakeOpCode("pop", 0),
+        MakeOpCode("push", 1), MakeOpCode("mov", 0), MakeOpCode("pop", 0)
+    };
+    fused.clear();
+    origin.clear();
+    Fuse(jumps, 0, fused, origin);
+    assert(fused == jumps);
+    ran_fast = fast.Execute(jumps);
+    assert(ran_fast);
+    VM::ImagePtr image = VM::Image::Make(table, program.value.symbols);
+    assert(image->fused == expected);
+    ran_fast = fast.Execute(image);
+    assert(ran_fast && fast.Slot(0) == 4);
+
+    /* a fault is where it was in the code given */
+    Result<Compiler::Program> zero = Compiler::Compile("int a;\na = 1 + 1;\na = a - 1 / 0;\n");
+    VM::VM plain_zero, fast_zero(true);
+    ran = plain_zero.Execute(zero.value.instructions);
+    ran_fast = fast_zero.Execute(zero.value.instructions);
+    assert(ran && ran_fast);
+    assert(plain_zero.Fault() >= 0 && fast_zero.Fault() == plain_zero.Fault());
+
+    /* only the vm makes them */
+    InstructionTable made = { MakeOpCode("alloc", 4), MakeOpCode("push", 1), MakeOpCode("store", 0) };
+    assert(!Verifier::Verify(made, SymbolTable(), FunctionTable()).ok);
+    printf("-----pass: fuse test-----\n\n");
+}
+
+void TestBytecode() {
+    printf("-----bytecode test-----\n");
+    using namespace CS;
+    using namespace OpCode;
+
+    /* operands of every width, and jumps both ways, survive a round trip */
+    InstructionTable table = {
+        MakeOpCode("alloc", 8), MakeOpCode("push", -1), MakeOpCode("push", 64),
+        MakeOpCode("push", -65), MakeOpCode("push", 1 << 30), MakeOpCode("push", -(1 << 30)),
+        MakeOpCode("jmp", 2), MakeOpCode("pop", 0), MakeOpCode("jmp", -2),
+        MakeOpCode("mov", 300), MakeOpCode("load", 1), MakeOpCode("ret", 0)
+    };
+    Bytecode::Code code;
+    std::vector<uint32_t> offsets;
+    bool done = Bytecode::Encode(table, code, &offsets);
+    assert(done);
+    assert(offsets.size() == table.size() + 1 && offsets.back() == code.size());
+    assert(code.size() == 2 + 2 + 3 + 3 + 6 + 6 + 5 + 1 + 5 + 3 + 2 + 1);
+    InstructionTable decoded;
+    done = Bytecode::Decode(code, decoded);
+    assert(done && decoded == table);
+    assert(Bytecode::Index(code, offsets[7]) == 7);
+
+    /* a jump out of the table, a cut operand and a jump into an operand are refused */
+    InstructionTable away = { MakeOpCode("jmp", 5) };
+    done = Bytecode::Encode(away, code);
+    assert(!done);
+    Bytecode::Code cut = { 1, 0x80 };
+    done = Bytecode::Decode(cut, decoded);
+    assert(!done);
+    Bytecode::Code inside = { 31, 0xfe, 0xff, 0xff, 0xff };
+    done = Bytecode::Decode(inside, decoded);
+    assert(!done);
+    VM::VM refused;
+    done = refused.Execute(cut);
+    assert(!done);
+
+    /* a program gives the same stack both ways, in less than a quarter of the bytes */
+    Result<Compiler::Program> program = Compiler::Compile(GetSourceCode());
+    assert(program.Ok());
+    done = Bytecode::Encode(program.value.instructions, code);
+    assert(done);
+    assert(code.size() * 4 < program.value.instructions.size() * sizeof(long long));
+    VM::VM wide;
+    VM::VM dense;
+    done = wide.Execute(program.value.instructions, program.value.symbols);
+    assert(done);
+    done = dense.Execute(code, program.value.symbols);
+    assert(done);
+    assert(wide.Depth() == dense.Depth());
+    for (int i = 0; i < wide.Depth(); i++)
+        assert(wide.Slot(i) == dense.Slot(i));
+
+    /* a fault is reported at the same instruction, the overflow of a division too */
+    const char* faults[] = {"int a;\na = 6;\nint b;\nb = a / (a - 6);\n",
+        "int a;\na = 2147483647;\na = 0 - a - 1;\na = a / (0 - 1);\n"};
+    for (const char* source: faults) {
+        program = Compiler::Compile(source);
+        done = Bytecode::Encode(program.value.instructions, code);
+        assert(done);
+        VM::VM faulty;
+        done = faulty.Execute(code, program.value.symbols);
+        assert(done);
+        VM::VM reference;
+        done = reference.Execute(program.value.instructions, program.value.symbols);
+        assert(done);
+        assert(faulty.Fault() >= 0 && faulty.Fault() == reference.Fault());
+    }
+    /* and counted after the code the vm ran before */
+    Result<Compiler::Program> before = Compiler::Compile("int c;\nc = 1;\n");
+    program = Compiler::Compile(faults[0]);
+    done = Bytecode::Encode(program.value.instructions, code);
+    assert(done);
+    VM::VM faulty;
+    done = faulty.Execute(before.value.instructions, before.value.symbols);
+    assert(done);
+    done = faulty.Execute(code, program.value.symbols);
+    assert(done);
+    VM::VM reference;
+    done = reference.Execute(before.value.instructions, before.value.symbols);
+    assert(done);
+    done = reference.Execute(program.value.instructions, program.value.symbols);
+    assert(done);
+    assert(faulty.Fault() >= static_cast<int>(before.value.instructions.size()));
+    assert(faulty.Fault() == reference.Fault());
+    printf("-----pass: bytecode test-----\n\n");
+}
+
+void TestArchive() {
+    printf("-----archive test-----\n");
+    using namespace CS;
+
+    /* repeats shrink, and anything comes back as it was */
+    std::vector<uint8_t> text;
+    for (int i = 0; i < 1000; i++)
+        text.push_back("abcabcabd"[i % 9]);
+    std::vector<uint8_t> packed = Compress::Compress(text);
+    assert(packed.size() < text.size() / 10);
+    std::vector<uint8_t> unpacked;
+    bool done = Compress::Decompress(packed.data(), packed.size(), unpacked, text.size());
+    assert(done && unpacked == text);
+    uint32_t seed = 1;
+    for (size_t size: { 0, 1, 12, 13, 300, 70000 }) {
+        std::vector<uint8_t> noise(size);
+        for (auto& byte: noise) {
+            seed = seed * 1103515245 + 12345;
+            byte = (seed >> 16) % 7;
+        }
+        packed = Compress::Compress(noise);
+        done = Compress::Decompress(packed.data(), packed.size(), unpacked, size);
+        assert(done && unpacked == noise);
+    }
+    /* a match before the start, and a size which does not add up, are refused */
+    uint8_t back[] = { 0x10, 'a', 0x05, 0x00 };
+    done = Compress::Decompress(back, sizeof(back), unpacked, 6);
+    assert(!done);
+    uint8_t literal[] = { 0x20, 'a', 'b' };
+    done = Compress::Decompress(literal, sizeof(literal), unpacked, 3);
+    assert(!done);
+
+    Result<Compiler::Program> main = Compiler::Compile(GetSourceCode());
+    Result<Compiler::Program> print = Compiler::Compile("int a;\na = 3;\nprintln(a);\n");
+    Archive::Writer writer;
+    done = writer.Add("main", main.value.instructions, main.value.symbols);
+    assert(done);
+    done = writer.Add("print", print.value.instructions, print.value.symbols);
+    assert(done);
+    done = writer.Save("./test.csar");
+    assert(done);
+
+    /* opening reads the index, running a program reads its section only */
+    Archive::Reader reader;
+    done = reader.Open("./test.csar");
+    assert(done);
+    assert(reader.Size() == 2 && reader.Contains("print") && reader.Loaded() == 0);
+    VM::VM vm;
+    VM::VM reference;
+    done = reader.Execute(vm, "main");
+    assert(done);
+    done = reference.Execute(main.value.instructions, main.value.symbols);
+    assert(done);
+    assert(reader.Loaded() == 1);
+    assert(vm.Depth() == reference.Depth());
+    for (int i = 0; i < vm.Depth(); i++)
+        assert(vm.Slot(i) == reference.Slot(i));
+    const Archive::Section* section = reader.Load("main");
+    const Archive::Section* again = reader.Load("main");
+    assert(section == again && reader.Loaded() == 1);
+    VM::VM printer;
+    done = reader.Execute(printer, "print");
+    assert(done && printer.Slot(0) == 3);
+    assert(reader.Loaded() == 2);
+    done = reader.Execute(printer, "none");
+    assert(!done);
+
+    /* a damaged section is refused when it is loaded, a damaged index when opened */
+    FILE* file = fopen("./test.csar", "r+b");
+    fseek(file, -3, SEEK_END);
+    fputc(0x7f, file);
+    fclose(file);
+    Archive::Reader damaged;
+    done = damaged.Open("./test.csar");
+    assert(done);
+    section = damaged.Load("main");
+    assert(section != nullptr);
+    section = damaged.Load("print");
+    assert(section == nullptr);
+    file = fopen("./test.csar", "r+b");
+    fseek(file, 12, SEEK_SET);
+    fputc(0xff, file);
+    fclose(file);
+    Archive::Reader broken;
+    done = broken.Open("./test.csar");
+    assert(!done && broken.Size() == 0);
+    done = broken.Open("./none.csar");
+    assert(!done);
+
+    /* so is a section claiming more than its packed bytes can make */
+    done = writer.Save("./test.csar");
+    assert(done);
+    file = fopen("./test.csar", "r+b");
+    fseek(file, 16 + 4 + 4 + 8 + 4, SEEK_SET);
+    for (int i = 0; i < 4; i++)
+        fputc(0xff, file);
+    fclose(file);
+    Archive::Reader bomb;
+    done = bomb.Open("./test.csar");
+    assert(done);
+    section = bomb.Load("main");
+    assert(section == nullptr);
+    section = bomb.Load("print");
+    assert(section != nullptr);
+    remove("./test.csar");
+    printf("-----pass: archive test-----\n\n");
+}
+
+void TestCache() {
+    printf("-----cache test-----\n");
+    using namespace CS;
+    const char* path = "./test.cs";
+    std::string cache = Cache::CachePath(path);
+    remove(cache.c_str());
+    FILE* file = fopen(path, "w");
+    fputs(GetSourceCode(), file);
+    fclose(file);
+
+    /* the first run compiles and caches, the next ones load the same program */
+    bool hit = true;
+    Result<Compiler::Program> compiled = Cache::CompileFile(path, &hit);
+    assert(compiled.Ok() && !hit);
+    Result<Compiler::Program> loaded = Cache::CompileFile(path, &hit);
+    assert(loaded.Ok() && hit);
+    assert(loaded.value.instructions == compiled.value.instructions);
+    assert(loaded.value.symbols == compiled.value.symbols);
+    assert(loaded.value.sources == compiled.value.sources);
+    VM::VM vm;
+    bool ran = vm.Execute(loaded.value.instructions, loaded.value.symbols);
+    assert(ran);
+
+    /* writers at once each write a file of their own, and the last rename wins */
+    std::string source_code = GetSourceCode();
+    std::atomic<int> failed(0);
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; t++) {
+        writers.emplace_back([&]() {
+            for (int i = 0; i < 50; i++)
+                if (!Cache::Store(cache, source_code, compiled.value))
+                    ++failed;
+        });
+    }
+    for (auto& writer: writers)
+        writer.join();
+    assert(failed == 0);
+    loaded = Cache::CompileFile(path, &hit);
+    assert(loaded.Ok() && hit && loaded.value.instructions == compiled.value.instructions);
+
+    /* a cache of another compiler, or a damaged one, is compiled over */
+    file = fopen(cache.c_str(), "r+b");
+    fseek(file, 4, SEEK_SET);
+    fputc(0xff, file);
+    fclose(file);
+    compiled = Cache::CompileFile(path, &hit);
+    assert(compiled.Ok() && !hit);
+    loaded = Cache::CompileFile(path, &hit);
+    assert(loaded.Ok() && hit);
+    file = fopen(cache.c_str(), "r+b");
+    fseek(file, -1, SEEK_END);
+    fputc(0xff, file);
+    fclose(file);
+    compiled = Cache::CompileFile(path, &hit);
+    assert(compiled.Ok() && !hit);
+
+    /* so is a changed source, even of the same size */
+    std::string source;
+    bool read = Cache::ReadFile(path, source);
+    assert(read);
+    source[source.find('1')] = '2';
+    file = fopen(path, "w");
+    fputs(source.c_str(), file);
+    fclose(file);
+    Result<Compiler::Program> changed = Cache::CompileFile(path, &hit);
+    assert(changed.Ok() && !hit && changed.value.instructions != compiled.value.instructions);
+
+    /* a script which does not compile is not cached */
+    file = fopen(path, "w");
+    fputs("a = 1 +;\n", file);
+    fclose(file);
+    Result<Compiler::Program> wrong = Cache::CompileFile(path, &hit);
+    assert(!wrong.Ok() && !hit);
+    wrong = Cache::CompileFile(path, &hit);
+    assert(!wrong.Ok() && !hit);
+    remove(path);
+    remove(cache.c_str());
+    Result<Compiler::Program> missing = Cache::CompileFile(path);
+    assert(missing.diagnostics[0].message == "cannot read ./test.cs");
+    printf("-----pass: cache test-----\n\n");
+}
+
+void TestSession() {
+    printf("-----session test-----\n");
+    CS::Session session;
+    Check(session, "int a;\n", "a = 0");
+    Check(session, "a = 1 + 1;\n", "a = 2");
+    Check(session, "int b;\n", "b = 0");
+    Check(session, "b = a * 3 - 1;\n", "b = 5");
+    /* a refused line leaves the session as it was */
+    Check(session, "b = foo(a);\n", "");
+    Check(session, "int c; c = b + a;\n", "c = 7");
+    Check(session, "c = -(c - 1) * (2 + 1);\n", "c = -18");
+    /* a line which faults leaves the stack as it was before it */
+    Check(session, "int d; d = a + 2 * (c / (b - 5));\n", "");
+    Check(session, "int d; d = c + 1;\n", "d = -17");
+    Check(session, "b = d - a;\n", "b = -19");
+    session.Evaluate("println(c);\n");
+    printf("-----pass: session test-----\n\n");
+}
+
+void TestDiagnostics() {
+    printf("-----diagnostics test-----\n");
+    using namespace CS;
+    const char* code =
+        "int a;\n"
+        "a = 1 +;\n"
+        "int b;\n"
+        "b = (a * 2;\n"
+        "c = 3;\n"
+        "a = 2 @ 3;\n"
+        "b = a + 1;\n";
+    Result<Compiler::Program> result = Compiler::Compile(code);
+    for (auto& i: result.diagnostics)
+        printf("%d: %s\n", i.offset, i.message.c_str());
+    assert(!result.Ok());
+    assert(result.diagnostics.size() == 5);
+
+    /* the scanner reports first, then the parser, then the encoder */
+    assert(result.diagnostics[0].offset == 48);
+    assert(result.diagnostics[1].offset == 14);
+    assert(result.diagnostics[2].offset == 33);
+    assert(result.diagnostics[3].offset == 50);
+    assert(result.diagnostics[4].offset == 35);
+    assert(result.diagnostics[4].message == "undefined variable: c");
+
+    /* what is left is still a valid program */
+    Verifier::StackInfo info = Verifier::AnalyzeStack(result.value.instructions);
+    assert(info.ok);
+    assert(info.exit_depth == 2);
+
+    /* the REPL keeps going */
+    Session session;
+    Check(session, "x = 1;\n", "undefined variable: x");
+    /* a slot holds an int, so a double is reported rather than truncated */
+    Check(session, "int x; x = 2.5 * 2;\n", "unsupported value: 2.5");
+    Check(session, "double d; d = 1.5;\n",
+            "unsupported value: double d\nunsupported value: 1.5\nundefined variable: d");
+    Check(session, "int x; x = 4;\n", "x = 4");
+
+    /* a number no stage can hold is reported where it is */
+    Result<Compiler::Program> huge = Compiler::Compile("int a;\na = 99999999999;\n");
+    assert(huge.diagnostics.size() == 2);
+    assert(huge.diagnostics[0].offset == 11);
+    assert(huge.diagnostics[0].message == "number out of range: 99999999999");
+    Check(session, "x = 2147483648;\n", "number out of range: 2147483648\nnot a value: ';'");
+    Check(session, "x = 2147483647;\n", "x = 2147483647");
+    /* a line rolled back gives a name it declared again its slot before */
+    Check(session, "int x; x = 1.5;\n", "unsupported value: 1.5");
+    Check(session, "x = x - 1;\n", "x = 2147483646");
+    CS::Evaluator eval;
+    Check(eval, "a = 99999999999;\n", "");
+    Check(eval, "a = 1.5;\n", "a = 1.500000");
+    printf("-----pass: diagnostics test-----\n\n");
+}
+
+void TestSource() {
+    printf("-----source test-----\n");
+    using namespace CS;
+    const char* code =
+        "int a;\n"
+        "a = 6;\n"
+        "int b;\n"
+        "  b = a / (a - 6);\n"
+        "c = 1;\n";
+    SourceMap source(code);
+    assert(source.Lines() == 6);
+    assert(source.Locate(0).line == 1);
+    assert(source.Locate(9).line == 2 && source.Locate(9).column == 3);
+
+    Result<Compiler::Program> result = Compiler::Compile(code);
+    assert(result.diagnostics.size() == 1);
+    std::string message = source.Format(result.diagnostics[0]);
+    std::cout << message << std::endl;
+    assert(message == "5:1: undefined variable: c");
+
+    /* a fault in the vm points at its statement */
+    VM::VM vm;
+    bool ran = vm.Execute(result.value.instructions, result.value.symbols);
+    assert(ran);
+    Location location = source.Locate(SourceOffset(result.value.sources, vm.Fault()));
+    assert(location.line == 4 && location.column == 3);
+    printf("-----pass: source test-----\n\n");
+}
+
+void TestParallelCompile() {
+    printf("-----parallel compile test-----\n");
+    using namespace CS;
+    std::string code;
+    for (int i = 0; i < 40; i++) {
+        std::string id = "v" + std::string(1, 'a' + i % 26) + std::string(1, 'a' + i / 26);
+        code += "int " + id + ";\n";
+        if (i > 0) {
+            std::string prev = "v" + std::string(1, 'a' + (i - 1) % 26) +
+                std::string(1, 'a' + (i - 1) / 26);
+            code += id + " = " + prev + " * 2 - " + std::to_string(i) + ";\n";
+        }
+        if (i % 7 == 0)
+            code += "println(" + id + ");\n";
+    }
+
+    Result<Compiler::Program> sequential = Compiler::Compile(code);
+    Result<Compiler::Program> parallel = Compiler::CompileParallel(code, 4, 3);
+    assert(sequential.Ok() && parallel.Ok());
+    assert(parallel.value.instructions == sequential.value.instructions);
+    assert(parallel.value.symbols == sequential.value.symbols);
+    assert(parallel.value.sources == sequential.value.sources);
+
+    /* a redeclaration in a later chunk hides the one before, and a string is never split */
+    const char* tricky[] = {"int a;\na = 1;\nint a;\na = 5;\nint b;\nb = a;\n",
+        "int c;\nprintln(\"x; } \\\" {;\");\nc = 1;\n"};
+    for (const char* source: tricky) {
+        Result<Compiler::Program> one = Compiler::Compile(source);
+        for (size_t chunk_size = 1; chunk_size <= 2; chunk_size++) {
+            Result<Compiler::Program> split = Compiler::CompileParallel(source, 2, chunk_size);
+            assert(split.value.instructions == one.value.instructions);
+            assert(split.value.symbols == one.value.symbols);
+            assert(split.diagnostics.size() == one.diagnostics.size());
+            for (size_t i = 0; i < one.diagnostics.size(); i++)
+                assert(split.diagnostics[i].offset == one.diagnostics[i].offset);
+        }
+    }
+
+    /* a variable used before any chunk declared it */
+    Result<Compiler::Program> undefined = Compiler::CompileParallel("int a;\na = b;\nint b;\n", 2, 1);
+    assert(undefined.diagnostics.size() == 1);
+    assert(undefined.diagnostics[0].offset == 11);
+    printf("-----pass: parallel compile test-----\n\n");
+}
+
+void TestTrace() {
+    printf("-----trace test------\n");
+    int evaluated = 0;
+#ifdef CS_TRACE
+    CS::Trace::Clear();
+    const char* code = "int a;\na = 1 + 2;\n";
+    Result<Compiler::Program> program = Compiler::Compile(code);
+    assert(program.Ok());
+    /* the stages happen within the compile, which ends last */
+    std::vector<CS::Trace::Event> events = CS::Trace::Events();
+    assert(CS::Trace::Total("instructions") == static_cast<long long>(program.value.instructions.size()));
+    long long tokens = CS::Trace::Total("tokens");
+    CS::TokenList scanned = CS::Scanner::Scan(code);
+    assert(tokens == static_cast<long long>(scanned.size()));
+    std::vector<std::string> scopes;
+    for (auto& i: events)
+        if (i.phase == 'X')
+            scopes.push_back(i.name);
+    assert((scopes == std::vector<std::string>{ "compile", "scan", "parse", "encode" }));
+    const CS::Trace::Event& compile = events[0];
+    for (auto& i: events)
+        assert(i.begin >= compile.begin && i.begin <= compile.begin + compile.value);
+
+    /* a ring keeps the newest events, the totals keep everything */
+    CS::Trace::Clear();
+    for (size_t i = 0; i < CS::Trace::kEvents + 10; i++)
+        CS_TRACE_COUNT("ticks", ++evaluated);
+    assert(CS::Trace::Events().size() == CS::Trace::kEvents);
+    assert(CS::Trace::Events().back().value == evaluated);
+    long long n = CS::Trace::kEvents + 10;
+    assert(CS::Trace::Total("ticks") == n * (n + 1) / 2);
+
+    /* every thread has its own ring, and all of them are exported */
+    CS::Trace::Clear();
+    std::string many = "int a;\n";
+    for (int i = 0; i < 32; i++)
+        many += "a = a + 1;\n";
+    Result<Compiler::Program> parallel = Compiler::CompileParallel(many, 4, 4);
+    assert(parallel.Ok());
+    std::set<int> threads;
+    for (auto& i: CS::Trace::Events())
+        if (std::string(i.name) == "compile chunk")
+            threads.insert(i.thread);
+    assert(!threads.empty());
+    std::string json;
+    CS::Trace::AppendJson(json);
+    assert(json.compare(0, 16, "{\"traceEvents\":[") == 0);
+    assert(json.find("\"name\":\"compile chunk\",\"cat\":\"cs\",\"ph\":\"X\"") != std::string::npos);
+    assert(json.find("\"args\":{\"count\":") != std::string::npos);
+    CS::Trace::Clear();
+#else
+    /* compiled out, the arguments are not even evaluated */
+    CS_TRACE_SCOPE("nothing");
+    CS_TRACE_COUNT("nothing", ++evaluated);
+    assert(evaluated == 0);
+#endif
+    printf("-----pass: trace test------\n\n");
+}
+
 int main()
 {
     TestScanner();
     TestParser();
     TestVariable();
     TestEvaluator();
+    TestEvaluation();
+    TestSharedExpression();
+    TestReactive();
+    TestScope();
+    TestString();
+    TestArray();
+    TestSimd();
+    TestInlineCache();
+    TestPool();
+    TestSnapshot();
     TestOpCode();
     TestStackModel();
     TestEncoder();
     TestSerializer();
+    TestVerifier();
     TestVM();
+    TestScheduler();
+    TestImage();
+    TestFuse();
+    TestBytecode();
+    TestArchive();
+    TestCache();
+    TestSession();
+    TestDiagnostics();
+    TestSource();
+    TestParallelCompile();
+    TestTrace();
     printf("\n------pass all test !------\n\n");
     return 0;
 }
@@ -0,0 +1,242 @@
+/**
+ * Where the time goes between the stages: scanning, parsing, encoding, evaluating and
+ * running on the vm. A stage is timed by a scope, with a monotonic clock, and counts
+ * what it handled, tokens, nodes or instructions. Each thread records into a ring of
+ * its own, the oldest events are overwritten, and the rings of every thread are
+ * exported together as Chrome trace events (chrome://tracing, Perfetto).
+ *
+ * It is compiled in with -DCS_TRACE only, otherwise CS_TRACE_SCOPE and CS_TRACE_COUNT
+ * are nothing, not even their arguments are evaluated.
+ */
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#define CS_TRACE_CONCAT_(a, b) a##b
+#define CS_TRACE_CONCAT(a, b) CS_TRACE_CONCAT_(a, b)
+
+#ifdef CS_TRACE
+#define CS_TRACE_SCOPE(name) CS::Trace::Scope CS_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define CS_TRACE_COUNT(name, n) CS::Trace::Count(name, n)
+#else
+#define CS_TRACE_SCOPE(name) ((void)0)
+#define CS_TRACE_COUNT(name, n) ((void)0)
+#endif
+
+#ifdef CS_TRACE
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "format.hpp"
+
+namespace CS {
+    namespace Trace {
+        using std::string;
+        using std::vector;
+
+        const size_t kEvents = 1 << 14; // per thread
+
+        /* names are string literals, they are kept as pointers */
+        struct Event {
+            const char* name;
+            char phase; // 'X' a timed scope, 'C' a count
+            int thread;
+            long long begin; // ns since the start of the process
+            long long value; // ns of a scope, or the count
+        };
+
+        inline long long Now() {
+            static const auto start = std::chrono::steady_clock::now();
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+        }
+
+        /*
+         * Written by its thread and read by an export, which is rare,
+         * so the lock is practically never contended.
+         */
+        class Ring {
+            public:
+                explicit Ring(int thread): events_(kEvents), next_(0), thread_(thread) {}
+
+                void Record(const char* name, char phase, long long begin, long long value) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    Event& event = events_[next_ % kEvents];
+                    event.name = name;
+                    event.phase = phase;
+                    event.thread = thread_;
+                    event.begin = begin;
+                    event.value = value;
+                    ++next_;
+                    if (phase == 'C')
+                        Total(name) += value;
+                }
+
+                /* the events still in the ring, oldest first */
+                void Collect(vector<Event>& out) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    size_t first = next_ > kEvents ? next_ - kEvents : 0;
+                    for (size_t i = first; i < next_; i++)
+                        out.push_back(events_[i % kEvents]);
+                }
+
+                long long Counted(const char* name) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    return Total(name);
+                }
+
+                void Clear() {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    next_ = 0;
+                    totals_.clear();
+                }
+
+            private:
+                /* a few names only, a search is cheaper than hashing */
+                long long& Total(const char* name) {
+                    for (auto& i: totals_)
+                        if (i.first == name || strcmp(i.first, name) == 0)
+                            return i.second;
+                    totals_.emplace_back(name, 0);
+                    return totals_.back().second;
+                }
+
+                std::mutex mutex_;
+                vector<Event> events_;
+                size_t next_; // events ever recorded
+                int thread_;
+                vector<std::pair<const char*, long long>> totals_; // never overwritten
+        };
+
+        /* every ring, kept after its thread ends so the export still has it */
+        class Registry {
+            public:
+                /* never destroyed, a thread may still record while statics go */
+                static Registry& Instance() {
+                    static Registry* registry = new Registry();
+                    return *registry;
+                }
+
+                Ring* NewRing() {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    rings_.emplace_back(new Ring(rings_.size() + 1));
+                    return rings_.back().get();
+                }
+
+                template <typename Fun>
+                void ForEach(Fun fun) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    for (auto& i: rings_)
+                        fun(*i);
+                }
+
+            private:
+                Registry() {}
+
+                std::mutex mutex_;
+                vector<std::unique_ptr<Ring>> rings_;
+        };
+
+        inline Ring& Local() {
+            static thread_local Ring* ring = Registry::Instance().NewRing();
+            return *ring;
+        }
+
+        inline void Count(const char* name, long long n) {
+            Local().Record(name, 'C', Now(), n);
+        }
+
+        class Scope {
+            public:
+                explicit Scope(const char* name): name_(name), begin_(Now()) {}
+
+                ~Scope() {
+                    Local().Record(name_, 'X', begin_, Now() - begin_);
+                }
+
+                Scope(const Scope&) = delete;
+                Scope& operator = (const Scope&) = delete;
+
+            private:
+                const char* name_;
+                long long begin_;
+        };
+
+        /* of every thread, by time */
+        inline vector<Event> Events() {
+            vector<Event> events;
+            Registry::Instance().ForEach([&](Ring& ring) { ring.Collect(events); });
+            std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) {
+                return a.begin < b.begin;
+            });
+            return events;
+        }
+
+        /* all counted under 'name' by every thread, including what the rings dropped */
+        inline long long Total(const char* name) {
+            long long total = 0;
+            Registry::Instance().ForEach([&](Ring& ring) { total += ring.Counted(name); });
+            return total;
+        }
+
+        inline void Clear() {
+            Registry::Instance().ForEach([](Ring& ring) { ring.Clear(); });
+        }
+
+        /* microseconds, as the format wants them, to the nanosecond */
+        inline void AppendMicros(string& out, long long ns) {
+            Format::AppendInt(out, ns / 1000);
+            int rest = static_cast<int>(ns % 1000);
+            char fraction[] = { '.', static_cast<char>('0' + rest / 100),
+                static_cast<char>('0' + rest / 10 % 10), static_cast<char>('0' + rest % 10) };
+            out.append(fraction, sizeof(fraction));
+        }
+
+        /* the trace event format: a complete event per scope, a counter event per count */
+        inline void AppendJson(string& out) {
+            vector<Event> events = Events();
+            out += "{\"traceEvents\":[";
+            for (size_t i = 0; i < events.size(); i++) {
+                const Event& event = events[i];
+                if (i)
+                    out += ",\n";
+                out += "{\"name\":\"";
+                out += event.name;
+                out += "\",\"cat\":\"cs\",\"ph\":\"";
+                out += event.phase;
+                out += "\",\"pid\":1,\"tid\":";
+                Format::AppendInt(out, event.thread);
+                out += ",\"ts\":";
+                AppendMicros(out, event.begin);
+                if (event.phase == 'X') {
+                    out += ",\"dur\":";
+                    AppendMicros(out, event.value);
+                } else {
+                    out += ",\"args\":{\"count\":";
+                    Format::AppendInt(out, event.value);
+                    out += "}";
+                }
+                out += "}";
+            }
+            out += "],\"displayTimeUnit\":\"ns\"}\n";
+        }
+
+        inline bool Save(const char* file_path) {
+            string json;
+            AppendJson(json);
+            FILE* output = fopen(file_path, "wb");
+            if (output == nullptr)
+                return false;
+            bool ok = fwrite(json.data(), 1, json.size(), output) == json.size();
+            return fclose(output) == 0 && ok;
+        }
+    }
+}
+#endif
+#endif
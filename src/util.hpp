@@ -7,26 +7,26 @@
 
 namespace CS {
 
-    int GetId(const string& key) {
-        return GetId(key.c_str());
-    }
-
+    /* lookups only, so it is safe to call from several threads */
     int GetId(const char* key) {
         static TokenMap& types = kTypes();
         static TokenMap& operators = kOperators();
         static TokenMap& keywords = kKeywords();
         static TokenMap& literals = kLiterals();
-        if (types.find(key) != types.end())
-            return types[key];
-        if (operators.find(key) != types.end())
-            return operators[key];
-        if (keywords.find(key) != keywords.end())
-            return keywords[key];
-        if (literals.find(key) != literals.end())
-            return literals[key];
+        string id(key);
+        TokenMap* maps[] = { &types, &operators, &keywords, &literals };
+        for (TokenMap* map : maps) {
+            auto i = map->find(id);
+            if (i != map->end())
+                return i->second;
+        }
         assert(false);
         return -1;
     }
 
+    int GetId(const string& key) {
+        return GetId(key.c_str());
+    }
+
 }
 #endif
@@ -2,6 +2,9 @@
 #define VARIABLE_HPP
 
 #include "util.hpp"
+#include "strings.hpp"
+#include "gc.hpp"
+#include "format.hpp"
 
 namespace CS {
 
@@ -9,6 +12,7 @@ union Value {
     int i;
     double d;
     void* p;
+    Strings::Handle s; // a reference held by the variable, see strings.hpp
 
     Value() {}
     Value(int ii): i(ii) {}
@@ -21,10 +25,11 @@ class Variable {
 
     /* constructor family */
 
-    Variable(): self(*this) {}
+    Variable(): v(0), type_id(0), self(*this) {}
 
-    Variable(Value& vv, int type_id_):
+    Variable(const Value& vv, int type_id_):
         v(vv), type_id(type_id_), self(*this) {
+            Retain();
         }
 
     Variable(double d):
@@ -39,6 +44,11 @@ class Variable {
         v(p), type_id(GetId("pointer")), self(*this) {
         }
 
+    /* a reference to an array on the heap of the evaluator, see gc.hpp */
+    Variable(GC::Array* array):
+        v(static_cast<void*>(array)), type_id(GetId("array")), self(*this) {
+        }
+
     // construct from TokenNode::value_ and TokenNode::type_
 
     Variable(const string& value, int type):
@@ -51,21 +61,43 @@ class Variable {
             case 2:
                 v.d = std::stod(value);
                 break;
+            case 4:
+                v.s = Strings::Make(value);
+                break;
             default:
                 assert(false);
         }
     }
 
+    /* take over a reference made by the string heap */
+    static Variable String(Strings::Handle s) {
+        Variable res;
+        res.v.s = s;
+        res.type_id = 4;
+        return res;
+    }
+
     Variable(const Variable& variable):
         v(variable.v), type_id(variable.type_id), self(*this) {
+            Retain();
         }
 
-    Variable operator = (const Variable& rhs) {
+    Variable& operator = (const Variable& rhs) {
+        Value old = this->v;
+        int old_type = this->type_id;
         this->v = rhs.v;
         this->type_id = rhs.type_id;
+        Retain();
+        if (old_type == 4)
+            Strings::Release(old.s);
         return *this;
     }
 
+    ~Variable() {
+        if (type_id == 4)
+            Strings::Release(v.s);
+    }
+
     /* constructor family end */
 
     int GetInt() const {
@@ -80,46 +112,59 @@ class Variable {
         return v.p;
     }
 
+    bool IsNumber() const {
+        return type_id == 1 || type_id == 2;
+    }
+
     double GetAny() const {
         if (type_id == 1) return v.i;
         else if (type_id == 2) return v.d;
         assert(false);
     }
 
-    void IllegalOperation(const char* message) const {
-        printf("invalid operation: %s\n", message);
+    /* no value, what an illegal operation gives and any operation on it */
+    bool Empty() const {
+        return type_id == 0;
+    }
+
+    /* reported once, where it happens, the empty result carries it to the statement */
+    Variable IllegalOperation(const char* message, const Variable& rhs) const {
+        if (!Empty() && !rhs.Empty())
+            Report(nullptr, -1, string("invalid operation: ") + message);
+        return Variable();
     }
 
     Variable operator + (const Variable& rhs) {
-        if (this->type_id == 1 && rhs.type_id == 1) {
+        if (this->type_id == 4 && rhs.type_id == 4) {
+            return String(Strings::Concat(v.s, rhs.v.s));
+        } else if (this->type_id == 4 || rhs.type_id == 4) {
+            return IllegalOperation("plus a string and a non string", rhs);
+        } else if (this->type_id == 1 && rhs.type_id == 1) {
             return Variable(GetInt() + rhs.GetInt());
-        } else if (this->type_id <= 2 && rhs.type_id <= 2) {
+        } else if (IsNumber() && rhs.IsNumber()) {
             return Variable(GetAny() + rhs.GetAny());
         } else {
-            IllegalOperation("plus a number and a pointer");
-            exit(5);
+            return IllegalOperation("plus a non number", rhs);
         }
     }
 
     Variable operator - (const Variable& rhs) {
         if (this->type_id == 1 && rhs.type_id == 1) {
-            return Variable(GetInt() - rhs.GetAny());
-        } else if (this->type_id <= 2 && rhs.type_id <= 2) {
+            return Variable(GetInt() - rhs.GetInt());
+        } else if (IsNumber() && rhs.IsNumber()) {
             return Variable(GetAny() - rhs.GetAny());
         } else {
-            IllegalOperation("minus a number and a pointer");
-            exit(5);
+            return IllegalOperation("minus a non number", rhs);
         }
     }
 
     Variable operator * (const Variable& rhs) {
         if (this->type_id == 1 && rhs.type_id == 1) {
-            return Variable(GetAny() * rhs.GetAny());
-        } else if (this->type_id <= 2 && rhs.type_id <= 2) {
+            return Variable(GetInt() * rhs.GetInt());
+        } else if (IsNumber() && rhs.IsNumber()) {
             return Variable(GetAny() * rhs.GetAny());
         } else {
-            IllegalOperation("multiply a number and a pointer");
-            exit(5);
+            return IllegalOperation("multiply a non number", rhs);
         }
 
     }
@@ -127,31 +172,94 @@ class Variable {
     Variable operator / (const Variable& rhs) {
         if (this->type_id == 1 && rhs.type_id == 1) {
             return Variable(GetAny() / rhs.GetAny());
-        } else if (this->type_id <= 2 && rhs.type_id <= 2) {
+        } else if (IsNumber() && rhs.IsNumber()) {
             return Variable(GetAny() / rhs.GetAny());
         } else {
-            IllegalOperation("devide a number and a pointer");
-            exit(5);
+            return IllegalOperation("devide a non number", rhs);
         }
 
     }
 
-    string to_string() {
+    /* numbers are equal by what they hold, strings by handle, pointers and arrays by address, 1 or 0 */
+    Variable operator == (const Variable& rhs) {
+        if (Empty() || rhs.Empty())
+            return Variable();
+        if (this->type_id == 4 || rhs.type_id == 4)
+            return Variable(this->type_id == rhs.type_id && v.s == rhs.v.s ? 1 : 0);
+        if (this->type_id == 1 && rhs.type_id == 1)
+            return Variable(GetInt() == rhs.GetInt() ? 1 : 0);
+        if (IsNumber() && rhs.IsNumber())
+            return Variable(GetAny() == rhs.GetAny() ? 1 : 0);
+        if (this->type_id == 3 || this->type_id == GetId("array"))
+            return Variable(this->type_id == rhs.type_id && v.p == rhs.v.p ? 1 : 0);
+        return Variable(0);
+    }
+
+    Variable operator != (const Variable& rhs) {
+        Variable equal = *this == rhs;
+        return equal.Empty() ? equal : Variable(equal.GetInt() ? 0 : 1);
+    }
+
+    string to_string() const {
+        string res;
+        Append(res);
+        return res;
+    }
+
+    /* the text of the value at the end of 'out' */
+    void Append(string& out, Format::Style style = Format::kFixed) const {
         switch (type_id) {
             case 1:
-                return std::to_string(v.i);
+                Format::AppendInt(out, v.i);
+                break;
             case 2:
-                return std::to_string(v.d);
-            case 3:
-                //return std::to_string(static_cast<int>(v.p));
+                Format::AppendDouble(out, v.d, style);
+                break;
+            case 3: {
+                char address[32];
+                int size = snprintf(address, sizeof(address), "%p", v.p);
+                out.append(address, size);
+                break;
+            }
+            case 4: {
+                size_t size = out.size();
+                out.resize(size + Strings::Size(v.s));
+                Strings::Copy(v.s, &out[size]);
+                break;
+            }
+            case 5:
+                AppendArray(out, static_cast<GC::Array*>(v.p), style);
+                break;
             default:
-                return string();
+                break;
         }
     }
+
+    /* the first elements only, an array may be large */
+    static void AppendArray(string& out, const GC::Array* array, Format::Style style) {
+        const uint32_t shown = 8;
+        out += '[';
+        for (uint32_t i = 0; i < array->length && i < shown; i++) {
+            if (i)
+                out += ", ";
+            if (array->type_id == 1)
+                Format::AppendInt(out, array->data[i].i);
+            else
+                Format::AppendDouble(out, array->data[i].d, style);
+        }
+        if (array->length > shown)
+            out += ", ...";
+        out += ']';
+    }
     
     Value v;
     int type_id;
     private:
+        void Retain() {
+            if (type_id == 4)
+                Strings::Retain(v.s);
+        }
+
         Variable& self;
 };
 } //end of namespace CS
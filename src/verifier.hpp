@@ -0,0 +1,216 @@
+/**
+ * Static analysis of the instructions emitted by the encoder.
+ * It walks every reachable instruction and simulates the depth of the operand stack,
+ * so the vm knows exactly how many slots a piece of code needs before running it,
+ * and code which pops more than it pushed is rejected up front.
+ */
+
+#ifndef VERIFIER_HPP
+#define VERIFIER_HPP
+#include <string>
+#include <vector>
+
+#include "opcode.hpp"
+#include "function.hpp"
+
+namespace CS {
+    namespace Verifier {
+        using std::string;
+        using std::vector;
+        using OpCode::InstructionTable;
+        using OpCode::SymbolTable;
+        using OpCode::SplitOpCode;
+
+        /* no program may ask for more slots than this */
+        const int kMaxDepth = 1 << 20;
+
+        struct StackInfo {
+            bool ok;
+            int max_depth;  // the deepest the operand stack could be, in slots
+            int exit_depth; // depth when control falls off the end of the table
+            string error;
+        };
+
+        /*
+         * The stack is split into variables (reserved by 'alloc') and operands.
+         * A statement is balanced when it leaves no operand behind.
+         */
+        struct Frame {
+            int locals;
+            int operands;
+
+            bool operator == (const Frame& rhs) const {
+                return locals == rhs.locals && operands == rhs.operands;
+            }
+        };
+
+        static StackInfo Reject(int pc, const string& message) {
+            StackInfo info = { false, 0, 0,
+                "instruction " + std::to_string(pc) + ": " + message };
+            return info;
+        }
+
+        /* 'entry_depth' is the number of slots already on the stack when the table starts */
+        static StackInfo AnalyzeStack(const InstructionTable& ins_tbl, int entry_depth = 0) {
+            const int size = ins_tbl.size();
+            const Frame unknown = { -1, -1 };
+            vector<Frame> frames(size + 1, unknown);
+            vector<int> worklist;
+            StackInfo info = { true, entry_depth, entry_depth, string() };
+
+            Frame entry = { 0, 0 };
+            if (size == 0) return info;
+            frames[0] = entry;
+            worklist.push_back(0);
+
+            while (!worklist.empty()) {
+                int pc = worklist.back();
+                worklist.pop_back();
+                Frame frame = frames[pc];
+
+                if (pc == size) {
+                    /* falls off the end */
+                    if (frame.operands != 0)
+                        return Reject(pc, "unbalanced stack, " +
+                                std::to_string(frame.operands) + " operands left");
+                    continue;
+                }
+
+                std::pair<int, int> op_val = SplitOpCode(ins_tbl[pc]);
+                int op = op_val.first;
+                int val = op_val.second;
+                int next = pc + 1;
+
+                switch (op) {
+                    /* push */
+                    case 1:
+                        frame.operands += 1;
+                        break;
+                    /* pop */
+                    case 2:
+                        if (frame.operands < 1)
+                            return Reject(pc, "pop without operand");
+                        frame.operands -= 1;
+                        break;
+                    /* mov */
+                    case 3:
+                        if (frame.operands < 1)
+                            return Reject(pc, "mov without operand");
+                        if (val < 0 || val >= entry_depth + frame.locals)
+                            return Reject(pc, "mov to a slot out of range");
+                        break;
+                    /* load */
+                    case 4:
+                        if (val < 0 || val >= entry_depth + frame.locals)
+                            return Reject(pc, "load from a slot out of range");
+                        frame.operands += 1;
+                        break;
+                    /* alloc */
+                    case 5:
+                        if (frame.operands != 0)
+                            return Reject(pc, "alloc above operands");
+                        if (val < 0)
+                            return Reject(pc, "alloc a negative size");
+                        frame.locals += val / static_cast<int>(sizeof(int));
+                        break;
+                    /* add, sub, mul, div */
+                    case 20:
+                    case 21:
+                    case 22:
+                    case 23:
+                        if (frame.operands < 2)
+                            return Reject(pc, "arithmetic needs two operands");
+                        frame.operands -= 1;
+                        break;
+                    /* call a builtin, the caller pops the arguments */
+                    case 30:
+                        break;
+                    /* jmp, relative to the next instruction */
+                    case 31:
+                        next = pc + 1 + val;
+                        if (next < 0 || next > size)
+                            return Reject(pc, "jump out of the table");
+                        break;
+                    /* ret, leaves the table like falling off the end */
+                    case 32:
+                        next = size;
+                        break;
+                    default:
+                        return Reject(pc, "unknown opcode " + std::to_string(op));
+                }
+
+                int depth = entry_depth + frame.locals + frame.operands;
+                if (depth > info.max_depth)
+                    info.max_depth = depth;
+                if (depth > kMaxDepth)
+                    return Reject(pc, "stack deeper than " + std::to_string(kMaxDepth));
+
+                if (frames[next] == unknown) {
+                    frames[next] = frame;
+                    worklist.push_back(next);
+                } else if (!(frames[next] == frame)) {
+                    return Reject(next, "stack depth differs between paths");
+                }
+            }
+
+            if (!(frames[size] == unknown))
+                info.exit_depth = entry_depth + frames[size].locals;
+            return info;
+        }
+
+        /*
+         * Check everything the vm takes on trust: the opcodes, their operands,
+         * the functions called, the jump targets and the stack.
+         * Once a table passes, the vm runs it without any check.
+         */
+        static StackInfo Verify(const InstructionTable& ins_tbl, const SymbolTable& sym_tbl,
+                const FunctionTable& builtins, int entry_depth = 0) {
+            vector<bool> callable;
+            for (auto& i: sym_tbl) {
+                if (i.second <= 0 || i.second > static_cast<int>(sym_tbl.size()))
+                    return Reject(0, "symbol " + i.first + " has a bad index");
+                if (builtins.find(i.first) == builtins.end())
+                    return Reject(0, "symbol " + i.first + " is not a function");
+                if (i.second >= static_cast<int>(callable.size()))
+                    callable.resize(i.second + 1, false);
+                callable[i.second] = true;
+            }
+
+            for (int pc = 0; pc < static_cast<int>(ins_tbl.size()); pc++) {
+                std::pair<int, int> op_val = SplitOpCode(ins_tbl[pc]);
+                int op = op_val.first;
+                int val = op_val.second;
+                switch (op) {
+                    /* push, mov, load and jmp are checked by the stack analysis */
+                    case 1:
+                    case 3:
+                    case 4:
+                    case 31:
+                        break;
+                    case 2:
+                    case 20:
+                    case 21:
+                    case 22:
+                    case 23:
+                    case 32:
+                        if (val != 0)
+                            return Reject(pc, "unexpected operand");
+                        break;
+                    case 5:
+                        if (val <= 0 || val % sizeof(int) != 0)
+                            return Reject(pc, "alloc a bad size");
+                        break;
+                    case 30:
+                        if (val <= 0 || val >= static_cast<int>(callable.size()) ||
+                                !callable[val])
+                            return Reject(pc, "call an unknown function");
+                        break;
+                    default:
+                        return Reject(pc, "unknown opcode " + std::to_string(op));
+                }
+            }
+            return AnalyzeStack(ins_tbl, entry_depth);
+        }
+    }
+}
+#endif
@@ -8,10 +8,19 @@
 #ifndef VM_HPP
 #define VM_HPP
 #include <cassert>
+#include <climits>
 #include <algorithm>
 #include <iterator>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
 
 #include "opcode.hpp"
+#include "bytecode.hpp"
+#include "verifier.hpp"
+#include "function.hpp"
+#include "image.hpp"
 
 namespace CS {
     namespace VM {
@@ -35,6 +44,16 @@ namespace CS {
                     return top_;
                 }
 
+                /* number of slots in use */
+                int Depth() const {
+                    return top_ + 1;
+                }
+
+                /* make room for 'capacity' slots, so Push never checks the bound */
+                void Reserve(int capacity) {
+                    if (capacity > capacity_) ReAlloc(capacity);
+                }
+
                 void ReSize(int new_size) {
                     top_ = new_size;
                 }
@@ -48,7 +67,6 @@ namespace CS {
                 }
 
                 void Push(int x) {
-                    if (top_ >= capacity_) ReAlloc();
                     data_[++top_] = x;
                 }
 
@@ -57,11 +75,11 @@ namespace CS {
                 }
 
             private:
-                void ReAlloc() {
+                void ReAlloc(int new_capacity) {
                     int old_capacity = capacity_;
                     int* old_data = data_;
 
-                    capacity_ *= 2;
+                    capacity_ = new_capacity;
                     data_ = new int[capacity_];
                     memcpy(data_, old_data, sizeof(int) * old_capacity);
                     delete[] old_data;
@@ -71,26 +89,268 @@ namespace CS {
                 int top_;
                 int capacity_;
         };
+
+        /* where Resume stopped */
+        enum Status {
+            kDone, // past the last instruction
+            kPreempted, // out of budget
+            kBlocked // in a builtin waiting for something
+        };
+
+        class VM;
+
+        /* a builtin which may have to wait, false when it is not ready and must be called again */
+        typedef bool(*Waiter)(VM& vm);
+
         class VM {
             public:
-                VM(): sym_tbl_(), ins_tbl_(), pc_(0), frame_p_(0) {
+                /*
+                 * 'fuse' runs the code loaded with superinstructions, see OpCode::Fuse.
+                 * The encoder makes straight code, run once per load, so fusing pays when
+                 * it is resumed in many short slices at most; an image is always fused.
+                 */
+                explicit VM(bool fuse = false): sym_tbl_(), ins_tbl_(), loaded_(0), code_(&ins_tbl_),
+                    origins_(&origin_), pc_(0), frame_p_(0), fault_(-1), depth_(0),
+                    user_data_(nullptr), fuse_(fuse) {
+                    Function::RegisterFunctions(builtins_);
                 }
                 ~VM() {}
 
+                VM(const VM&) = delete;
+                VM& operator = (const VM&) = delete;
+
                 void LoadSymbolTable(const SymbolTable& sym_tbl) {
                     sym_tbl_.insert(sym_tbl.begin(), sym_tbl.end());
+                    for (auto& i: sym_tbl) {
+                        if (i.second >= static_cast<int>(fun_tbl_.size())) {
+                            fun_tbl_.resize(i.second + 1, nullptr);
+                            wait_tbl_.resize(i.second + 1, nullptr);
+                        }
+                        auto builtin = builtins_.find(i.first);
+                        if (builtin != builtins_.end())
+                            fun_tbl_[i.second] = builtin->second;
+                        auto waiter = waiters_.find(i.first);
+                        if (waiter != waiters_.end())
+                            wait_tbl_[i.second] = waiter->second;
+                    }
+                }
+
+                /* a builtin the code may call, and which may block it, see Resume */
+                void Register(const string& name, Waiter waiter) {
+                    /* known to the verifier as any builtin, with no function of its own */
+                    builtins_[name] = nullptr;
+                    waiters_[name] = waiter;
+                }
+
+                /* what the code may call, see Image::Make */
+                const FunctionTable& Builtins() const {
+                    return builtins_;
+                }
+
+                /* for the waiters, the vm only keeps it */
+                void* UserData() const {
+                    return user_data_;
+                }
+
+                void SetUserData(void* data) {
+                    user_data_ = data;
+                }
+
+                /*
+                 * The code is verified once before running it, including the stack it needs,
+                 * so the stack is allocated once and Run trusts every instruction.
+                 */
+                bool Execute(const InstructionTable& ins_tbl) {
+                    return Execute(ins_tbl, SymbolTable());
+                }
+
+                /*
+                 * The symbols are loaded only if the code passes.
+                 * A program blocked in a waiter stops there, and goes on with Resume.
+                 */
+                bool Execute(const InstructionTable& ins_tbl, const SymbolTable& sym_tbl) {
+                    CS_TRACE_SCOPE("execute");
+                    if (!Load(ins_tbl, sym_tbl))
+                        return false;
+                    Loop<false>(0);
+                    return true;
+                }
+
+                /*
+                 * Verify and take the code, without running it. It is verified from the depth
+                 * the code loaded before leaves, which has not necessarily run yet.
+                 */
+                bool Load(const InstructionTable& ins_tbl, const SymbolTable& sym_tbl) {
+                    CS_TRACE_COUNT("vm instructions", ins_tbl.size());
+                    /* appending to a shared image, the vm goes on with a copy of its own */
+                    if (image_) {
+                        ins_tbl_ = image_->fused;
+                        origin_ = image_->origin;
+                        loaded_ = image_->instructions.size();
+                        code_ = &ins_tbl_;
+                        origins_ = &origin_;
+                        image_.reset();
+                    }
+                    SymbolTable symbols(sym_tbl_);
+                    symbols.insert(sym_tbl.begin(), sym_tbl.end());
+                    Verifier::StackInfo info =
+                        Verifier::Verify(ins_tbl, symbols, builtins_, depth_);
+                    if (!info.ok) {
+                        std::cerr << "verify error: " << info.error << std::endl;
+                        return false;
+                    }
+                    LoadSymbolTable(sym_tbl);
+                    stack_.Reserve(info.max_depth);
+                    depth_ = info.exit_depth;
+                    if (fuse_) {
+                        OpCode::Fuse(ins_tbl, loaded_, ins_tbl_, origin_);
+                    } else {
+                        ins_tbl_.insert(ins_tbl_.end(), ins_tbl.begin(), ins_tbl.end());
+                        for (size_t i = 0; i < ins_tbl.size(); i++)
+                            origin_.push_back(loaded_ + i);
+                    }
+                    loaded_ += ins_tbl.size();
+                    return true;
+                }
+
+                /*
+                 * Run a shared image, without copying it, from the start and an empty stack,
+                 * dropping what the vm ran before. It is only checked against the builtins.
+                 */
+                bool Load(ImagePtr image) {
+                    if (!image)
+                        return false;
+                    for (auto& i: image->symbols) {
+                        if (builtins_.find(i.first) == builtins_.end()) {
+                            std::cerr << "verify error: symbol " << i.first << " is not a function"
+                                << std::endl;
+                            return false;
+                        }
+                    }
+                    sym_tbl_.clear();
+                    fun_tbl_.clear();
+                    wait_tbl_.clear();
+                    LoadSymbolTable(image->symbols);
+                    stack_.ReSize(-1);
+                    stack_.Reserve(image->max_depth);
+                    ins_tbl_.clear();
+                    origin_.clear();
+                    loaded_ = 0;
+                    pc_ = 0;
+                    fault_ = -1;
+                    depth_ = image->exit_depth;
+                    image_ = std::move(image);
+                    code_ = &image_->fused;
+                    origins_ = &image_->origin;
+                    return true;
+                }
+
+                bool Execute(ImagePtr image) {
+                    CS_TRACE_SCOPE("execute");
+                    if (!Load(std::move(image)))
+                        return false;
+                    Loop<false>(0);
+                    return true;
+                }
+
+                /* what the vm runs now, nullptr for code of its own */
+                const ImagePtr& Shared() const {
+                    return image_;
+                }
+
+                /*
+                 * Run at most 'budget' instructions of the loaded code. A waiter which is
+                 * not ready leaves the vm on its call, so resuming calls it again.
+                 */
+                Status Resume(long budget) {
+                    return Loop<true>(budget);
+                }
+
+                bool Done() const {
+                    return pc_ >= static_cast<int>(code_->size());
+                }
+
+                /*
+                 * The dense form runs as it is, on the same stack and symbols, after the code
+                 * loaded before; it is decoded once to be verified. Faults are still counted
+                 * in instructions, from the first one loaded, so the code counts as loaded.
+                 */
+                bool Execute(const Bytecode::Code& code) {
+                    return Execute(code, SymbolTable());
+                }
+
+                bool Execute(const Bytecode::Code& code, const SymbolTable& sym_tbl) {
+                    CS_TRACE_SCOPE("execute");
+                    CS_TRACE_COUNT("vm bytes", code.size());
+                    InstructionTable ins_tbl;
+                    if (!Bytecode::Decode(code, ins_tbl)) {
+                        std::cerr << "decode error: malformed bytecode" << std::endl;
+                        return false;
+                    }
+                    SymbolTable symbols(sym_tbl_);
+                    symbols.insert(sym_tbl.begin(), sym_tbl.end());
+                    Verifier::StackInfo info =
+                        Verifier::Verify(ins_tbl, symbols, builtins_, depth_);
+                    if (!info.ok) {
+                        std::cerr << "verify error: " << info.error << std::endl;
+                        return false;
+                    }
+                    /* the code before first, so the stack is as verified */
+                    if (Loop<false>(0) == kBlocked) {
+                        std::cerr << "vm error: blocked in a waiter" << std::endl;
+                        return false;
+                    }
+                    LoadSymbolTable(sym_tbl);
+                    stack_.Reserve(info.max_depth);
+                    depth_ = info.exit_depth;
+                    int fault = Run(code.data(), code.data() + code.size());
+                    if (fault >= 0) {
+                        fault_ = static_cast<int>(loaded_) + Bytecode::Index(code, fault);
+                        depth_ = stack_.Depth();
+                    }
+                    loaded_ += ins_tbl.size();
+                    return true;
+                }
+
+                int Depth() const {
+                    return stack_.Depth();
+                }
+
+                /* the instruction which stopped the vm, -1 if none; see SourceOffset */
+                int Fault() const {
+                    return fault_;
                 }
 
-                void Execute(const InstructionTable& ins_tbl) {
-                    ins_tbl_.insert(ins_tbl_.end(),
-                            ins_tbl.begin(), ins_tbl.end());
-                    Run();
+                /* forget a fault, and what it left on the stack above 'depth', to load more code */
+                void Recover(int depth) {
+                    stack_.ReSize(depth - 1);
+                    depth_ = depth;
+                    fault_ = -1;
+                }
+
+                /* value of a variable, by the slot the encoder gave it */
+                int Slot(int slot) {
+                    return stack_[slot];
                 }
 
             private:
-                void Run() {
-                    while (pc_ < ins_tbl_.size()) {
-                    long long ins = ins_tbl_[pc_++];
+                /* what a division would do that C++ leaves undefined, nullptr if nothing */
+                static const char* DivisionFault(int dividend, int divisor) {
+                    if (divisor == 0)
+                        return "division by zero";
+                    if (divisor == -1 && dividend == INT_MIN)
+                        return "division overflow";
+                    return nullptr;
+                }
+
+                /* only verified code reaches here, the budget is not even counted without kBudget */
+                template <bool kBudget>
+                Status Loop(long budget) {
+                    const InstructionTable& code = *code_;
+                    while (pc_ < static_cast<int>(code.size())) {
+                    if (kBudget && budget-- <= 0)
+                        return kPreempted;
+                    long long ins = code[pc_++];
 #ifndef NDEBUG
                     printf("%016llx\n", ins);
 #endif
@@ -110,14 +370,11 @@ namespace CS {
                             break;
                         case 4:
                             stack_.Push(stack_[val]);
+                            break;
                         case 5:
-                            for (int i = 0; i < val/sizeof(int); i++)
+                            for (int i = 0; i < static_cast<int>(val / sizeof(int)); i++)
                                 stack_.Push(0);
                             break;
-                        case 6:
-                        case 7:
-                        case 8:
-                            
                         case 20:
                             stack_.Top2() += stack_.Top();
                             stack_.Pop();
@@ -131,37 +388,140 @@ namespace CS {
                             stack_.Pop();
                             break;
                         case 23:
+                            /* the only faults the verifier could not rule out */
+                            if (const char* fault = DivisionFault(stack_.Top2(), stack_.Top())) {
+                                fault_ = (*origins_)[pc_ - 1];
+                                /* the rest is skipped, so the code after starts from here */
+                                depth_ = stack_.Depth();
+                                std::cerr << fault << " at instruction " << fault_ << std::endl;
+                                pc_ = code.size();
+                                break;
+                            }
                             stack_.Top2() /= stack_.Top();
                             stack_.Pop();
                             break;
-                        case 24:
-                        case 25:
                         /* function call */
                         case 30:
-                            /* have not finish this part */
-                            stack_.Push(pc_);
-                            frame_p_ = stack_.Size();
-                            //pc_ = fun_tbl_[val];
+                            /* builtins only, the arguments are popped by the caller */
+                            if (fun_tbl_[val]) {
+                                fun_tbl_[val]();
+                            } else if (!wait_tbl_[val](*this)) {
+                                --pc_;
+                                return kBlocked;
+                            }
                             break;
                         case 31:
-                            pc_ = stack_[frame_p_] + val;
+                            pc_ += val;
                             break;
+                        /* no user function yet, so ret leaves the program */
                         case 32:
-                            pc_ = stack_[frame_p_];
-                            stack_.ReSize(frame_p_);
+                            pc_ = code.size();
+                            break;
+                        /* superinstructions */
+                        case 40:
+                            stack_[val] = stack_.Top();
+                            stack_.Pop();
+                            break;
+                        case 41:
+                            stack_.Top() += val;
+                            break;
+                        case 42:
+                            stack_.Top() -= val;
+                            break;
+                        default:
+                            __builtin_unreachable();
+                    }
+                    }
+                    return kDone;
+                }
+
+                /* the same instructions one byte opcode at a time, gives the byte of a fault or -1 */
+                int Run(const uint8_t* begin, const uint8_t* end) {
+                    const uint8_t* p = begin;
+                    while (p < end) {
+                    const uint8_t* ins = p;
+                    switch (*p++) {
+                        case 1:
+                            stack_.Push(Bytecode::ReadSigned(p));
+                            break;
+                        case 2:
+                            stack_.Pop();
+                            break;
+                        case 3:
+                            stack_[Bytecode::ReadUnsigned(p)] = stack_.Top();
+                            break;
+                        case 4:
+                            stack_.Push(stack_[Bytecode::ReadUnsigned(p)]);
+                            break;
+                        case 5: {
+                            int val = Bytecode::ReadUnsigned(p);
+                            for (int i = 0; i < static_cast<int>(val / sizeof(int)); i++)
+                                stack_.Push(0);
+                            break;
+                        }
+                        case 20:
+                            stack_.Top2() += stack_.Top();
+                            stack_.Pop();
+                            break;
+                        case 21:
+                            stack_.Top2() -= stack_.Top();
+                            stack_.Pop();
+                            break;
+                        case 22:
+                            stack_.Top2() *= stack_.Top();
+                            stack_.Pop();
+                            break;
+                        case 23:
+                            if (const char* fault = DivisionFault(stack_.Top2(), stack_.Top())) {
+                                std::cerr << fault << " at byte " << ins - begin << std::endl;
+                                return ins - begin;
+                            }
+                            stack_.Top2() /= stack_.Top();
+                            stack_.Pop();
                             break;
+                        case 30: {
+                            int val = Bytecode::ReadUnsigned(p);
+                            if (fun_tbl_[val]) {
+                                fun_tbl_[val]();
+                                break;
+                            }
+                            /* the dense form cannot stop halfway, it waits on this thread */
+                            while (!wait_tbl_[val](*this))
+                                std::this_thread::yield();
+                            break;
+                        }
+                        case 31: {
+                            int val = Bytecode::ReadJump(p);
+                            p += val;
+                            break;
+                        }
+                        case 32:
+                            return -1;
                         default:
-                            puts("unknown opcode");
-                            assert(false);
+                            __builtin_unreachable();
                     }
                     }
+                    return -1;
                 }
 
                 SymbolTable sym_tbl_;
-                InstructionTable ins_tbl_;
+                FunctionTable builtins_;
+                std::vector<FunPtr> fun_tbl_; // indexed by the symbol table
+                std::unordered_map<string, Waiter> waiters_;
+                std::vector<Waiter> wait_tbl_; // where fun_tbl_ has none
+                InstructionTable ins_tbl_; // code of its own, fused if fuse_
+                std::vector<int> origin_; // of each instruction in ins_tbl_, in the code loaded
+                size_t loaded_; // instructions loaded, as they were given
+                ImagePtr image_; // or shared
+                const InstructionTable* code_; // either
+                const std::vector<int>* origins_;
                 int pc_;
                 int frame_p_; // point to the frame
+                int fault_;
+                int depth_; // the stack left by the code loaded, once it has run
                 OpStack stack_;
+                void* user_data_;
+                bool fuse_;
         };
     }
 }